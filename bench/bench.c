@@ -0,0 +1,314 @@
+/*
+  Copyright (C) 2025  leleneme
+  This file is part of huffman, which is free software:
+  you can redistribute it and/or modify   it under the terms of the
+  GNU General Public License as published by the Free Software Foundation,
+  either version 3 of the License, or (at your option) any later version.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Times every phase of compression over synthetic corpora and prints the
+// results as JSON. The corpora are generated from a fixed seed, so results can
+// be compared from one version to the next.
+
+// for clock_gettime and getrusage
+#define _DEFAULT_SOURCE
+
+#include "args.h"
+#include "huffman.h"
+#include "fformat.h"
+#include <errno.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define DEFAULT_SIZE (4 << 20)
+#define DEFAULT_ITERATIONS 10
+#define MESSAGE_SIZE 100
+
+enum phase {
+    PHASE_FREQUENCIES,
+    PHASE_TREE,
+    PHASE_ENCODE,
+    PHASE_COMPRESS,
+    PHASE_DECOMPRESS,
+    PHASE_COUNT,
+};
+
+static const char* PHASE_NAMES[PHASE_COUNT] = {
+    "frequencies_build",
+    "htree_build",
+    "htree_encode",
+    "fformat_compress",
+    "fformat_decompress",
+};
+
+struct timing {
+    u64 best_ns;  // fastest iteration
+    u64 total_ns; // all iterations
+};
+
+// A corpus is compressed as messages of `message_size` bytes, one archive each
+struct corpus {
+    const char* name;
+    void (*generate)(u8* data, usize len, u64* state);
+    usize message_size; // 0 for the whole corpus as a single message
+};
+
+static u64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+// xorshift64*, every corpus starts from the same seed
+static u64 next_random(u64* state) {
+    u64 x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+static void generate_text(u8* data, usize len, u64* state) {
+    static const char* words[] = {
+        "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was", "with", "be", "by",
+        "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had",
+        "they", "you", "were", "their", "one", "all", "we", "can", "her", "has", "there", "been", "if",
+        "more", "when", "will", "would", "who", "so", "no", "compression", "table", "symbol", "block",
+    };
+
+    usize i = 0;
+    bool capital = true;
+    while (i < len) {
+        // Squaring the draw favors the first, most common, words
+        u64 r = next_random(state) % 1000;
+        const char* word = words[(r * r / 1000) * countof(words) / 1000];
+
+        for (usize k = 0; word[k] && i < len; k++)
+            data[i++] = (u8)(capital && k == 0 ? word[k] - 'a' + 'A' : word[k]);
+
+        capital = false;
+        u64 end = next_random(state) % 100;
+        const char* separator = end < 6 ? ". " : end < 10 ? ", " : end < 12 ? ".\n" : " ";
+        capital = end < 6 || (end >= 10 && end < 12);
+
+        for (usize k = 0; separator[k] && i < len; k++)
+            data[i++] = (u8)separator[k];
+    }
+}
+
+static void generate_random(u8* data, usize len, u64* state) {
+    for (usize i = 0; i < len; i++)
+        data[i] = (u8)next_random(state);
+}
+
+// Every byte is half as likely as the one before it
+static void generate_skewed(u8* data, usize len, u64* state) {
+    for (usize i = 0; i < len; i++) {
+        u64 r = next_random(state) | (1ull << 63);
+        data[i] = (u8)__builtin_ctzll(r);
+    }
+}
+
+static void generate_runs(u8* data, usize len, u64* state) {
+    for (usize i = 0; i < len;) {
+        u8 c = (u8)next_random(state);
+        usize run = 1 + next_random(state) % 300;
+        for (usize k = 0; k < run && i < len; k++)
+            data[i++] = c;
+    }
+}
+
+static const struct corpus CORPORA[] = {
+    { "text", generate_text, 0 },
+    { "random", generate_random, 0 },
+    { "skewed", generate_skewed, 0 },
+    { "runs", generate_runs, 0 },
+    { "messages", generate_text, MESSAGE_SIZE },
+};
+
+// Compresses every message of `data` once, adding the time of every phase to
+// `iteration`. Returns the total compressed size, or 0 if a message didn't
+// decompress to itself.
+static usize run_messages(struct buffer_u8 data, usize message_size, const struct fformat_options* options, u64 iteration[PHASE_COUNT]) {
+    struct htree* tree = malloc(sizeof(struct htree));
+    struct hcode codes[ALPHABET_SIZE];
+    struct buffer_hcode code_map = { .data = codes, .len = ALPHABET_SIZE };
+    usize compressed_size = 0;
+    bool ok = tree != NULL;
+
+    for (usize offset = 0; ok && offset < data.len; offset += message_size) {
+        struct buffer_u8 message = {
+            .data = data.data + offset,
+            .len = data.len - offset < message_size ? data.len - offset : message_size,
+        };
+
+        u64 t0 = now_ns();
+        struct buffer_usize freqs = frequencies_build(&message);
+        u64 t1 = now_ns();
+        struct pqueue queue = pqueue_build(tree, freqs);
+        struct helement* root = htree_build(tree, &queue);
+        u64 t2 = now_ns();
+        memset(codes, 0, sizeof(codes));
+        htree_encode(root, &code_map, 0, 0);
+        u64 t3 = now_ns();
+        buffer_free(&freqs);
+
+        struct buffer_u8 compressed, decompressed;
+        u64 t4 = now_ns();
+        ok = fformat_compress_buffer(&compressed, &message, options);
+        u64 t5 = now_ns();
+        ok = ok && fformat_decompress_buffer(&decompressed, &compressed, 1, NULL);
+        u64 t6 = now_ns();
+
+        ok = ok && decompressed.len == message.len && memcmp(decompressed.data, message.data, message.len) == 0;
+        compressed_size += compressed.len;
+        buffer_free(&compressed);
+        buffer_free(&decompressed);
+
+        iteration[PHASE_FREQUENCIES] += t1 - t0;
+        iteration[PHASE_TREE] += t2 - t1;
+        iteration[PHASE_ENCODE] += t3 - t2;
+        iteration[PHASE_COMPRESS] += t5 - t4;
+        iteration[PHASE_DECOMPRESS] += t6 - t5;
+    }
+
+    free(tree);
+    return ok ? compressed_size : 0;
+}
+
+// The peak of the whole process so far, which never goes down: a corpus run
+// after a larger one reports the peak of the larger one
+static long process_peak_rss_kb(void) {
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+}
+
+static bool run_corpus(const struct corpus* corpus, usize size, usize iterations, const struct fformat_options* options, bool last) {
+    struct buffer_u8 data;
+    buffer_alloc(&data, size);
+    if (!data.data) {
+        fprintf(stderr, "failed to allocate corpus: %s\n", strerror(errno));
+        return false;
+    }
+
+    u64 state = 0x9e3779b97f4a7c15ull;
+    corpus->generate(data.data, data.len, &state);
+    usize message_size = corpus->message_size ? corpus->message_size : size;
+
+    struct timing timings[PHASE_COUNT] = { 0 };
+    usize compressed_size = 0;
+    for (usize it = 0; it < iterations; it++) {
+        u64 iteration[PHASE_COUNT] = { 0 };
+        compressed_size = run_messages(data, message_size, options, iteration);
+        if (compressed_size == 0) {
+            fprintf(stderr, "corpus '%s' didn't decompress to itself\n", corpus->name);
+            buffer_free(&data);
+            return false;
+        }
+
+        for (usize p = 0; p < PHASE_COUNT; p++) {
+            if (it == 0 || iteration[p] < timings[p].best_ns)
+                timings[p].best_ns = iteration[p];
+            timings[p].total_ns += iteration[p];
+        }
+    }
+
+    printf("    {\n");
+    printf("      \"name\": \"%s\",\n", corpus->name);
+    printf("      \"size\": %zu,\n", size);
+    printf("      \"messages\": %zu,\n", (size + message_size - 1) / message_size);
+    printf("      \"compressed_size\": %zu,\n", compressed_size);
+    printf("      \"ratio\": %.4f,\n", (double)size / compressed_size);
+    printf("      \"phases\": {\n");
+    for (usize p = 0; p < PHASE_COUNT; p++) {
+        double best = timings[p].best_ns ? (double)timings[p].best_ns : 1;
+        printf("        \"%s\": { \"best_ns\": %llu, \"mean_ns\": %llu, \"mb_per_s\": %.2f, \"ns_per_byte\": %.4f }%s\n",
+            PHASE_NAMES[p], (unsigned long long)timings[p].best_ns, (unsigned long long)(timings[p].total_ns / iterations),
+            size / best * 1e9 / (1 << 20), best / size, p + 1 < PHASE_COUNT ? "," : "");
+    }
+    printf("      },\n");
+    printf("      \"process_peak_rss_kb\": %ld\n", process_peak_rss_kb());
+    printf("    }%s\n", last ? "" : ",");
+
+    buffer_free(&data);
+    return true;
+}
+
+static void usage(const char* program, FILE* file) {
+    fprintf(file, "usage: %s [options]\n", program);
+    fprintf(file, "options:\n");
+    fprintf(file, "  -n <size>  size of every corpus in bytes, K and M suffixes allowed (default: 4M)\n");
+    fprintf(file, "  -i <n>     iterations per corpus, the fastest one is reported as best (default: %d)\n", DEFAULT_ITERATIONS);
+    fprintf(file, "  -b <size>  compress in blocks of <size> bytes (default: 1M)\n");
+    fprintf(file, "  -l <bits>  limit code lengths to 8..%d bits (default: %d)\n", FFORMAT_MAX_CODE_LEN, FFORMAT_MAX_CODE_LEN);
+    fprintf(file, "  -c <name>  only run the named corpus: text, random, skewed, runs or messages\n");
+    fprintf(file, "  -C         compress with context blocks, see fformat.h\n");
+    fprintf(file, "  -B         Burrows-Wheeler code blocks ahead of the Huffman codes, see fformat.h\n");
+}
+
+int main(int argc, char** argv) {
+    unsigned long size = DEFAULT_SIZE, iterations = DEFAULT_ITERATIONS;
+    const char* only = NULL;
+    struct fformat_options options = fformat_default_options();
+
+    for (int i = 1; i < argc; i++) {
+        unsigned long value;
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc && parse_size(argv[i + 1], 1, ULONG_MAX, &size)) {
+            i++;
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc && parse_size(argv[i + 1], 1, 1000000, &iterations)) {
+            i++;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc
+            && parse_size(argv[i + 1], FFORMAT_MIN_BLOCK_SIZE, FFORMAT_MAX_BLOCK_SIZE, &value)) {
+            options.block_size = value;
+            i++;
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc && parse_ulong(argv[i + 1], 8, FFORMAT_MAX_CODE_LEN, &value)) {
+            options.max_code_len = (u8)value;
+            i++;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "-C") == 0) {
+            options.context = true;
+        } else if (strcmp(argv[i], "-B") == 0) {
+            options.bwt = true;
+        } else {
+            fprintf(stderr, "invalid argument '%s'\n", argv[i]);
+            usage(argv[0], stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    usize last = countof(CORPORA);
+    for (usize c = 0; c < countof(CORPORA); c++) {
+        if (!only || strcmp(only, CORPORA[c].name) == 0)
+            last = c;
+    }
+
+    if (last == countof(CORPORA)) {
+        fprintf(stderr, "unknown corpus '%s'\n", only);
+        return EXIT_FAILURE;
+    }
+
+    printf("{\n");
+    printf("  \"iterations\": %lu,\n", iterations);
+    printf("  \"block_size\": %zu,\n", options.block_size);
+    printf("  \"max_code_len\": %u,\n", options.max_code_len);
+    printf("  \"context\": %s,\n", options.context ? "true" : "false");
+    printf("  \"bwt\": %s,\n", options.bwt ? "true" : "false");
+    printf("  \"corpora\": [\n");
+
+    for (usize c = 0; c <= last; c++) {
+        if (only && strcmp(only, CORPORA[c].name) != 0)
+            continue;
+
+        if (!run_corpus(&CORPORA[c], size, iterations, &options, c == last))
+            return EXIT_FAILURE;
+    }
+
+    printf("  ]\n");
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,53 @@
+/*
+  Copyright (C) 2025  leleneme
+  This file is part of huffman, which is free software:
+  you can redistribute it and/or modify   it under the terms of the
+  GNU General Public License as published by the Free Software Foundation,
+  either version 3 of the License, or (at your option) any later version.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "args.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+bool parse_ulong(const char* text, unsigned long min, unsigned long max, unsigned long* out) {
+    char* end;
+    errno = 0;
+    unsigned long value = strtoul(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || value < min || value > max)
+        return false;
+
+    *out = value;
+    return true;
+}
+
+bool parse_size(const char* text, unsigned long min, unsigned long max, unsigned long* out) {
+    char* end;
+    errno = 0;
+    unsigned long value = strtoul(text, &end, 10);
+    if (errno != 0 || end == text)
+        return false;
+
+    // Sizes that don't fit once scaled are rejected, instead of wrapping around
+    unsigned shift = 0;
+    if (*end == 'K' || *end == 'k')
+        shift = 10;
+    else if (*end == 'M' || *end == 'm')
+        shift = 20;
+
+    if (shift) {
+        if (value > (ULONG_MAX >> shift))
+            return false;
+        value <<= shift;
+        end++;
+    }
+
+    if (*end != '\0' || value < min || value > max)
+        return false;
+
+    *out = value;
+    return true;
+}
@@ -0,0 +1,24 @@
+/*
+  Copyright (C) 2025  leleneme
+  This file is part of huffman, which is free software:
+  you can redistribute it and/or modify   it under the terms of the
+  GNU General Public License as published by the Free Software Foundation,
+  either version 3 of the License, or (at your option) any later version.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HF_ARGS_H
+#define HF_ARGS_H
+
+#include <stdbool.h>
+
+// Command-line parsing shared by the program and the benchmark
+
+// Parses a base 10 number from `min` to `max`, the whole text must be the number
+bool parse_ulong(const char* text, unsigned long min, unsigned long max, unsigned long* out);
+
+// Like parse_ulong, but accepts a K (KiB) or M (MiB) suffix
+bool parse_size(const char* text, unsigned long min, unsigned long max, unsigned long* out);
+
+#endif
@@ -0,0 +1,132 @@
+/*
+  Copyright (C) 2025  leleneme
+  This file is part of huffman, which is free software:
+  you can redistribute it and/or modify   it under the terms of the
+  GNU General Public License as published by the Free Software Foundation,
+  either version 3 of the License, or (at your option) any later version.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HF_BITSTREAM_H
+#define HF_BITSTREAM_H
+
+// for be64toh and htobe64
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include "huffman.h"
+#include <stdbool.h>
+#include <endian.h>
+
+// Bits are stored MSB-first: the first bit of the stream is the most
+// significant bit of the first byte.
+
+// Reads bits through a 64-bit buffer. The next unread bit is always the most
+// significant bit of `bits`, so peeking n bits is a single shift.
+struct bitreader {
+    const u8* data;
+    usize len;
+    usize pos;   // next byte to be loaded into the buffer
+    u64 bits;    // buffered bits, left aligned
+    u32 count;   // how many bits of `bits` are valid
+};
+
+static inline struct bitreader bitreader_make(const u8* data, usize len) {
+    struct bitreader br = { .data = data, .len = len, .pos = 0, .bits = 0, .count = 0 };
+    return br;
+}
+
+// Ensures at least 56 bits are buffered. Reading past the end of the data
+// yields zero bits; use bitreader_overrun to detect it afterwards.
+static inline void bitreader_refill(struct bitreader* br) {
+    if (br->pos + 8 <= br->len) {
+        u64 word;
+        memcpy(&word, br->data + br->pos, sizeof(word));
+        br->bits |= be64toh(word) >> br->count;
+        br->pos += (63 - br->count) >> 3;
+        br->count |= 56;
+        return;
+    }
+
+    while (br->count <= 56) {
+        u64 byte = br->pos < br->len ? br->data[br->pos] : 0;
+        br->bits |= byte << (56 - br->count);
+        br->pos++;
+        br->count += 8;
+    }
+}
+
+// Returns the next n (1..32) bits without consuming them
+static inline u32 bitreader_peek(struct bitreader* br, u32 n) {
+    return (u32)(br->bits >> (64 - n));
+}
+
+static inline void bitreader_consume(struct bitreader* br, u32 n) {
+    br->bits <<= n;
+    br->count -= n;
+}
+
+// True if more bits were consumed than the data holds
+static inline bool bitreader_overrun(struct bitreader* br) {
+    return br->pos * 8 - br->count > br->len * 8;
+}
+
+// Collects bits in a 64-bit accumulator and stores them 8 bytes at a time.
+// Stores near the end of the buffer fall back to writing single bytes.
+struct bitwriter {
+    u8* data;
+    usize capacity;
+    usize pos;   // bytes stored so far
+    u64 bits;    // pending bits, left aligned
+    u32 count;   // how many bits of `bits` are pending
+};
+
+static inline struct bitwriter bitwriter_make(u8* data, usize capacity) {
+    struct bitwriter bw = { .data = data, .capacity = capacity, .pos = 0, .bits = 0, .count = 0 };
+    return bw;
+}
+
+// Stores every complete byte of the accumulator, leaving at most 7 bits pending
+static inline void bitwriter_flush(struct bitwriter* bw) {
+    if (bw->pos + 8 <= bw->capacity) {
+        u64 word = htobe64(bw->bits);
+        memcpy(bw->data + bw->pos, &word, sizeof(word));
+        bw->pos += bw->count >> 3;
+        bw->bits <<= bw->count & ~7u;
+        bw->count &= 7;
+        return;
+    }
+
+    while (bw->count >= 8) {
+        bw->data[bw->pos++] = (u8)(bw->bits >> 56);
+        bw->bits <<= 8;
+        bw->count -= 8;
+    }
+}
+
+// Appends the low `len` (1..16) bits of `code`, the code must not have any
+// bits set above `len`
+static inline void bitwriter_put(struct bitwriter* bw, u32 code, u32 len) {
+    bw->bits |= (u64)code << (64 - bw->count - len);
+    bw->count += len;
+
+    if (bw->count >= 48)
+        bitwriter_flush(bw);
+}
+
+// Stores the pending bits, padding the last byte with zeroes, and returns how
+// many bytes were written in total
+static inline usize bitwriter_finish(struct bitwriter* bw) {
+    bitwriter_flush(bw);
+    if (bw->count > 0) {
+        bw->data[bw->pos++] = (u8)(bw->bits >> 56);
+        bw->bits = 0;
+        bw->count = 0;
+    }
+
+    return bw->pos;
+}
+
+#endif
@@ -0,0 +1,390 @@
+/*
+  Copyright (C) 2025  leleneme
+  This file is part of huffman, which is free software:
+  you can redistribute it and/or modify   it under the terms of the
+  GNU General Public License as published by the Free Software Foundation,
+  either version 3 of the License, or (at your option) any later version.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "bwt.h"
+
+typedef int32_t i32;
+
+// Suffix arrays are built by induced sorting (SA-IS, Nong, Zhang and Chan), in
+// linear time. The text is either the bytes of a block followed by a sentinel
+// smaller than any byte, which is never stored, or the names of a reduced
+// problem, which already end with a unique smallest name.
+struct sais_text {
+    const u8* bytes;
+    const i32* names;
+    i32 n; // sentinel included
+};
+
+// Scratch memory taken and given back in stack order, one level of the
+// recursion after the other
+struct sais_work {
+    u8* data;
+    usize used;
+};
+
+static inline i32 sais_chr(const struct sais_text* s, i32 i) {
+    if (s->names)
+        return s->names[i];
+    return i == s->n - 1 ? 0 : s->bytes[i] + 1;
+}
+
+static void* sais_take(struct sais_work* work, usize size) {
+    void* p = work->data + work->used;
+    work->used += (size + 7) & ~(usize)7;
+    return p;
+}
+
+// Suffixes are S-type (1) when smaller than the suffix after them, L-type (0)
+// otherwise
+static inline bool type_get(const u8* types, i32 i) {
+    return (types[i >> 3] >> (i & 7)) & 1;
+}
+
+// Leftmost S-type suffixes, the ones after an L-type suffix
+static inline bool is_lms(const u8* types, i32 i) {
+    return i > 0 && type_get(types, i) && !type_get(types, i - 1);
+}
+
+// Where the bucket of every symbol from 0 to `k` starts, or ends
+static void sais_buckets(const struct sais_text* s, i32* buckets, i32 k, bool end) {
+    memset(buckets, 0, (usize)(k + 1) * sizeof(i32));
+    for (i32 i = 0; i < s->n; i++)
+        buckets[sais_chr(s, i)]++;
+
+    i32 sum = 0;
+    for (i32 c = 0; c <= k; c++) {
+        sum += buckets[c];
+        buckets[c] = end ? sum : sum - buckets[c];
+    }
+}
+
+// Sorts the L-type suffixes from the ones already in `sa`, then the S-type ones
+static void sais_induce(const struct sais_text* s, const u8* types, i32* sa, i32* buckets, i32 k) {
+    sais_buckets(s, buckets, k, false);
+    for (i32 i = 0; i < s->n; i++) {
+        i32 j = sa[i] - 1;
+        if (j >= 0 && !type_get(types, j))
+            sa[buckets[sais_chr(s, j)]++] = j;
+    }
+
+    sais_buckets(s, buckets, k, true);
+    for (i32 i = s->n - 1; i >= 0; i--) {
+        i32 j = sa[i] - 1;
+        if (j >= 0 && type_get(types, j))
+            sa[--buckets[sais_chr(s, j)]] = j;
+    }
+}
+
+// Sorts the suffixes of a text of at least 2 symbols from 0 to `k` into `sa`
+static void sais(const struct sais_text* s, i32* sa, i32 k, struct sais_work* work) {
+    i32 n = s->n;
+    usize mark = work->used;
+
+    u8* types = sais_take(work, (usize)n / 8 + 1);
+    memset(types, 0, (usize)n / 8 + 1);
+    types[(n - 1) >> 3] |= 1 << ((n - 1) & 7);
+    for (i32 i = n - 3; i >= 0; i--) {
+        i32 a = sais_chr(s, i), b = sais_chr(s, i + 1);
+        if (a < b || (a == b && type_get(types, i + 1)))
+            types[i >> 3] |= 1 << (i & 7);
+    }
+
+    // Sorts the LMS substrings, the ones from an LMS suffix to the next
+    usize buckets_mark = work->used;
+    i32* buckets = sais_take(work, (usize)(k + 1) * sizeof(i32));
+    sais_buckets(s, buckets, k, true);
+    for (i32 i = 0; i < n; i++)
+        sa[i] = -1;
+    for (i32 i = 1; i < n; i++) {
+        if (is_lms(types, i))
+            sa[--buckets[sais_chr(s, i)]] = i;
+    }
+    sais_induce(s, types, sa, buckets, k);
+    work->used = buckets_mark;
+
+    i32 n1 = 0;
+    for (i32 i = 0; i < n; i++) {
+        if (is_lms(types, sa[i]))
+            sa[n1++] = sa[i];
+    }
+
+    // Names every LMS substring by its rank, equal substrings share a name.
+    // LMS suffixes are at least 2 apart, so position / 2 gives each a slot.
+    for (i32 i = n1; i < n; i++)
+        sa[i] = -1;
+
+    i32 name = 0, prev = -1;
+    for (i32 i = 0; i < n1; i++) {
+        i32 pos = sa[i];
+        bool diff = false;
+        for (i32 d = 0; d < n; d++) {
+            if (prev == -1 || sais_chr(s, pos + d) != sais_chr(s, prev + d) || type_get(types, pos + d) != type_get(types, prev + d)) {
+                diff = true;
+                break;
+            }
+            if (d > 0 && (is_lms(types, pos + d) || is_lms(types, prev + d)))
+                break;
+        }
+
+        if (diff) {
+            name++;
+            prev = pos;
+        }
+        sa[n1 + pos / 2] = name - 1;
+    }
+
+    for (i32 i = n - 1, j = n - 1; i >= n1; i--) {
+        if (sa[i] >= 0)
+            sa[j--] = sa[i];
+    }
+
+    // The names, in text order, are the reduced problem. Sorting its suffixes
+    // sorts the LMS suffixes, which only takes recursing when names repeat.
+    i32* s1 = sa + n - n1;
+    if (name < n1) {
+        struct sais_text reduced = { .names = s1, .n = n1 };
+        sais(&reduced, sa, name - 1, work);
+    } else {
+        for (i32 i = 0; i < n1; i++)
+            sa[s1[i]] = i;
+    }
+
+    // Induces the order of every suffix from the sorted LMS suffixes
+    buckets = sais_take(work, (usize)(k + 1) * sizeof(i32));
+    sais_buckets(s, buckets, k, true);
+    for (i32 i = 1, j = 0; i < n; i++) {
+        if (is_lms(types, i))
+            s1[j++] = i;
+    }
+    for (i32 i = 0; i < n1; i++)
+        sa[i] = s1[sa[i]];
+    for (i32 i = n1; i < n; i++)
+        sa[i] = -1;
+    for (i32 i = n1 - 1; i >= 0; i--) {
+        i32 j = sa[i];
+        sa[i] = -1;
+        sa[--buckets[sais_chr(s, j)]] = j;
+    }
+    sais_induce(s, types, sa, buckets, k);
+
+    work->used = mark;
+}
+
+// The suffix array of `len` bytes and their sentinel
+static usize sa_size(usize len) {
+    return ((len + 1) * sizeof(i32) + 7) & ~(usize)7;
+}
+
+// What sais takes from its scratch memory: the types of every level, each one
+// at most half the size of the one above it, and the largest bucket array,
+// the 257 symbols of the block or the names of half of it
+static usize sais_work_size(usize len) {
+    return (len + 1) / 4 + 2 * (len + 1) + 2048;
+}
+
+// Move-to-front codes every byte as its position in a list of the bytes, most
+// recent first, which the transform turns into mostly small positions. Runs of
+// zeros are written in bijective base 2 with the digits ZRUN_A (1) and ZRUN_B
+// (2), least significant first. Position p is written as p + 1, and positions
+// that don't fit as ZRUN_ESCAPE followed by p - (ZRUN_ESCAPE - 1).
+#define ZRUN_A 0
+#define ZRUN_B 1
+#define ZRUN_ESCAPE 255
+
+usize bwt_bound(usize len) {
+    return 2 * len;
+}
+
+usize bwt_encode_scratch(usize len) {
+    return sa_size(len) + sais_work_size(len);
+}
+
+usize bwt_decode_scratch(usize len) {
+    return (len + 1) * sizeof(u32) + len;
+}
+
+static usize put_run(u8* out, usize size, usize run) {
+    while (run > 0) {
+        out[size++] = (run & 1) ? ZRUN_A : ZRUN_B;
+        run = (run - 1) >> 1;
+    }
+
+    return size;
+}
+
+static usize mtf_encode(const u8* in, usize len, u8* out) {
+    u8 order[ALPHABET_SIZE];
+    for (usize i = 0; i < ALPHABET_SIZE; i++)
+        order[i] = (u8)i;
+
+    usize size = 0, run = 0;
+    for (usize i = 0; i < len; i++) {
+        u8 c = in[i];
+        if (order[0] == c) {
+            run++;
+            continue;
+        }
+
+        size = put_run(out, size, run);
+        run = 0;
+
+        // Moves the bytes before c one place down while looking for it
+        u8 prev = order[0];
+        usize p = 1;
+        order[0] = c;
+        while (order[p] != c) {
+            u8 next = order[p];
+            order[p] = prev;
+            prev = next;
+            p++;
+        }
+        order[p] = prev;
+
+        if (p + 1 < ZRUN_ESCAPE) {
+            out[size++] = (u8)(p + 1);
+        } else {
+            out[size++] = ZRUN_ESCAPE;
+            out[size++] = (u8)(p - (ZRUN_ESCAPE - 1));
+        }
+    }
+
+    return put_run(out, size, run);
+}
+
+static bool mtf_decode(const u8* in, usize len, u8* out, usize out_len) {
+    u8 order[ALPHABET_SIZE];
+    for (usize i = 0; i < ALPHABET_SIZE; i++)
+        order[i] = (u8)i;
+
+    usize size = 0, run = 0, weight = 1;
+    bool ok = true;
+    for (usize i = 0; i < len && ok; i++) {
+        u8 sym = in[i];
+        if (sym <= ZRUN_B) {
+            // Runs can't go past the block, which also keeps `weight` small
+            run += (usize)(sym + 1) * weight;
+            weight <<= 1;
+            ok = run <= out_len - size;
+            continue;
+        }
+
+        memset(out + size, order[0], run);
+        size += run;
+        run = 0;
+        weight = 1;
+
+        usize p = sym - 1;
+        if (sym == ZRUN_ESCAPE) {
+            ok = i + 1 < len && in[i + 1] <= 1;
+            if (ok)
+                p = ZRUN_ESCAPE - 1 + in[++i];
+        }
+
+        ok = ok && size < out_len;
+        if (ok) {
+            u8 c = order[p];
+            memmove(order + 1, order, p);
+            order[0] = c;
+            out[size++] = c;
+        }
+    }
+
+    if (ok) {
+        memset(out + size, order[0], run);
+        size += run;
+    }
+
+    if (!ok || size != out_len) {
+        fprintf(stderr, "error: move-to-front coded data doesn't match the block size, is the file ill formatted?\n");
+        return false;
+    }
+
+    return true;
+}
+
+usize bwt_encode(const u8* in, usize len, u8* scratch, u32* origin) {
+    i32* sa = (i32*)scratch;
+    struct sais_work work = { .data = scratch + sa_size(len), .used = 0 };
+    struct sais_text text = { .bytes = in, .n = (i32)len + 1 };
+    sais(&text, sa, ALPHABET_SIZE, &work);
+
+    // The last column of the sorted rotations, where the row of the block
+    // itself ends with the sentinel, which is left out. The suffix array is
+    // done with once the column is out, so the coded bytes replace it.
+    u8* last = work.data;
+    usize size = 0;
+    *origin = 0;
+    for (usize r = 0; r <= len; r++) {
+        if (sa[r] == 0)
+            *origin = (u32)r;
+        else
+            last[size++] = in[sa[r] - 1];
+    }
+
+    return mtf_encode(last, len, scratch);
+}
+
+bool bwt_decode(const u8* coded, usize coded_len, u32 origin, u8* out, usize len, u8* scratch) {
+    // Row 0 is the rotation starting with the sentinel, so the block is at
+    // any row but that one
+    if (origin == 0 || origin > len) {
+        fprintf(stderr, "error: invalid Burrows-Wheeler row %u, is the file ill formatted?\n", origin);
+        return false;
+    }
+
+    u32* next = (u32*)scratch;
+    u8* last = scratch + (len + 1) * sizeof(u32);
+    if (!mtf_decode(coded, coded_len, last, len))
+        return false;
+
+    // The rows of the first column that hold each byte, in order, after row 0
+    usize counts[ALPHABET_SIZE] = { 0 };
+    for (usize i = 0; i < len; i++)
+        counts[last[i]]++;
+
+    usize starts[ALPHABET_SIZE];
+    usize sum = 1;
+    for (usize c = 0; c < ALPHABET_SIZE; c++) {
+        starts[c] = sum;
+        sum += counts[c];
+    }
+
+    // The k-th time a byte is in the first column is the k-th time it is in
+    // the last one, whose row is the rotation starting right after it. Every
+    // row then links to the row of the byte that follows its first byte.
+    // Rows fit in 24 bits for most blocks, and the byte goes in the other 8,
+    // which saves looking it up in `last` at every step.
+    if (len < (1u << 24)) {
+        next[0] = origin << 8;
+        for (usize i = 0; i < len; i++) {
+            usize row = i + (i >= origin);
+            next[starts[last[i]]++] = (u32)(row << 8) | last[i];
+        }
+
+        u32 row = origin;
+        for (usize k = 0; k < len; k++) {
+            u32 link = next[row];
+            out[k] = (u8)link;
+            row = link >> 8;
+        }
+    } else {
+        next[0] = origin;
+        for (usize i = 0; i < len; i++)
+            next[starts[last[i]]++] = (u32)(i + (i >= origin));
+
+        u32 row = origin;
+        for (usize k = 0; k < len; k++) {
+            row = next[row];
+            out[k] = last[row - (row >= origin)];
+        }
+    }
+
+    return true;
+}
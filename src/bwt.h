@@ -0,0 +1,37 @@
+/*
+  Copyright (C) 2025  leleneme
+  This file is part of huffman, which is free software:
+  you can redistribute it and/or modify   it under the terms of the
+  GNU General Public License as published by the Free Software Foundation,
+  either version 3 of the License, or (at your option) any later version.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HF_BWT_H
+#define HF_BWT_H
+
+#include "huffman.h"
+#include <stdbool.h>
+
+// Burrows-Wheeler transform of a block followed by move-to-front and zero-run
+// coding, see Burrows-Wheeler Coding in fformat.h. Both directions work in
+// scratch memory given by the caller, linear in the block size.
+
+// The largest coded size of `len` bytes
+usize bwt_bound(usize len);
+
+// Scratch memory bwt_encode and bwt_decode need for blocks of up to `len` bytes
+usize bwt_encode_scratch(usize len);
+usize bwt_decode_scratch(usize len);
+
+// Transforms and codes the `len` (1 or more) bytes of `in` into the start of
+// `scratch`, returning the coded size. `origin` gets the row of the original
+// block among the sorted rotations, which bwt_decode needs to undo the transform.
+usize bwt_encode(const u8* in, usize len, u8* scratch, u32* origin);
+
+// Undoes bwt_encode, decoding `coded_len` bytes into the `len` bytes of `out`.
+// `coded` may point to the start of `scratch`.
+bool bwt_decode(const u8* coded, usize coded_len, u32 origin, u8* out, usize len, u8* scratch);
+
+#endif
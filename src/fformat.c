@@ -12,6 +12,10 @@
 #define _DEFAULT_SOURCE
 
 #include "fformat.h"
+#include "bitstream.h"
+#include "bwt.h"
+#include "pool.h"
+#include "stats.h"
 #include <stdbool.h>
 #include <assert.h>
 #include <endian.h>
@@ -45,225 +49,2770 @@ read_macro(u8, )
 #undef write_macro
 
 #define HCODE_ENTRY_SIZE (sizeof(u8) + sizeof(u16) + sizeof(u8))
+#define ORIGINAL_SIZE_OFFSET (countof(FILE_MAGIC) + 2 * sizeof(u8) + sizeof(u32))
+#define FILE_HEADER_SIZE (ORIGINAL_SIZE_OFFSET + sizeof(u64))
+#define BLOCK_HEADER_SIZE (2 * sizeof(u8) + 2 * sizeof(u32))
+#define INDEX_ENTRY_SIZE (2 * sizeof(u64) + 2 * sizeof(u32))
+#define INDEX_TRAILER_SIZE (sizeof(u64) + countof(INDEX_MAGIC))
 
-bool fformat_compress(struct io_stream* io, struct buffer_hcode code_map, struct buffer_u8* input) {
-    // This needs to be here since clang-format fucks up the line above, because of stupid macro formatting
-    // clang-format on
+static u8 INDEX_MAGIC[4] = { 0x6c, 0x62, 0x63, 0x69 }; // lbci
+static u8 TABLE_MAGIC[5] = { 0x0, 0x6c, 0x62, 0x63, 0x74 }; // \0lbct
+
+// Blocks start right after the file header, or after the table ID that follows it
+static usize blocks_offset(u8 flags) {
+    return FILE_HEADER_SIZE + ((flags & FILE_FLAG_TABLE) ? sizeof(u32) : 0);
+}
+
+static inline void store_u32_le(u8* dst, u32 value) {
+    u32 le = htole32(value);
+    memcpy(dst, &le, sizeof(le));
+}
+
+static inline void store_u64_le(u8* dst, u64 value) {
+    u64 le = htole64(value);
+    memcpy(dst, &le, sizeof(le));
+}
+
+static inline u32 load_u32_le(const u8* src) {
+    u32 le;
+    memcpy(&le, src, sizeof(le));
+    return le32toh(le);
+}
+
+static inline u64 load_u64_le(const u8* src) {
+    u64 le;
+    memcpy(&le, src, sizeof(le));
+    return le64toh(le);
+}
+
+// Stores the code lengths of all symbols as runs, returns the size in bytes
+static usize code_lengths_pack(struct buffer_hcode codes, u8* out) {
+    assert(codes.len == ALPHABET_SIZE);
+
+    usize size = 0;
+    for (usize i = 0; i < codes.len;) {
+        u8 len = codes.data[i].bit_len;
+        usize run = 1;
+        while (i + run < codes.len && run < 16 && codes.data[i + run].bit_len == len)
+            run++;
+
+        out[size++] = (u8)((len << 4) | (run - 1));
+        i += run;
+    }
 
-    usize code_count = 0;
-    u8 max_code_len = 0;
+    return size;
+}
 
-    for (usize i = 0; i < code_map.len; i++) {
-        struct hcode code = code_map.data[i];
-        if (code.bit_len > 0) {
-            code_count++;
+// Reads the code lengths stored by code_lengths_pack, returns how many bytes
+// the table takes or 0 if it is ill formatted
+static usize code_lengths_unpack(const u8* data, usize len, struct buffer_hcode* codes) {
+    usize size = 0;
+    for (usize i = 0; i < ALPHABET_SIZE;) {
+        if (size >= len) {
+            fprintf(stderr, "error: unexpected end of code lengths table\n");
+            return 0;
+        }
 
-            if (code.bit_len > max_code_len)
-                max_code_len = code.bit_len;
+        u8 run = data[size++];
+        usize run_len = (run & 0xf) + 1;
+        if (i + run_len > ALPHABET_SIZE) {
+            fprintf(stderr, "error: code lengths table is ill formatted\n");
+            return 0;
         }
+
+        for (usize j = 0; j < run_len; j++)
+            codes->data[i++].bit_len = run >> 4;
     }
 
-    io_write(io, (void*)FILE_MAGIC, countof(FILE_MAGIC));
-    io_write_u64_le(io, (u64)input->len);
+    return size;
+}
+
+static inline bool decode_symbol(const struct hdecoder* dec, struct bitreader* br, u8* out) {
+    struct hdecode_entry entry = dec->primary[bitreader_peek(br, HDECODE_PRIMARY_BITS)];
+    if (entry.sub_bits) {
+        u32 index = (u32)((br->bits << HDECODE_PRIMARY_BITS) >> (64 - entry.sub_bits));
+        entry = dec->secondary[entry.value + index];
+    }
 
-    u32 offset_to_content = countof(FILE_MAGIC) + sizeof(u64) + sizeof(u32) + (code_count * HCODE_ENTRY_SIZE);
-    io_write_u32_le(io, offset_to_content);
+    if (entry.len == 0)
+        return false;
 
-    for (usize i = 0; i < code_map.len; i++) {
-        struct hcode code = code_map.data[i];
-        if (code.bit_len == 0)
-            continue;
+    *out = (u8)entry.value;
+    bitreader_consume(br, entry.len);
+    return true;
+}
+
+// Decodes all the codes that fit in the next lookup, or a single longer code.
+// Always writes HDECODE_MULTI_MAX bytes, returns how many symbols were decoded
+// or 0 for an invalid code.
+static inline usize decode_multi(const struct hdecoder* dec, struct bitreader* br, u8* out) {
+    struct hdecode_multi entry = dec->multi[bitreader_peek(br, HDECODE_PRIMARY_BITS)];
+    if (entry.count == 0)
+        return decode_symbol(dec, br, out) ? 1 : 0;
+
+    memcpy(out, entry.symbols, HDECODE_MULTI_MAX);
+    bitreader_consume(br, entry.len);
+    return entry.count;
+}
+
+// Decodes exactly `len` symbols. Every refill guarantees 56 buffered bits, which
+// is enough for three codes of up to HCODE_MAX_LEN bits, or three lookups.
+static bool decode_symbols(const struct hdecoder* dec, struct bitreader* br, u8* out, usize len) {
+    usize i = 0;
+    bool ok = true;
+
+    while (dec->multi_symbol && i + 3 * HDECODE_MULTI_MAX <= len && ok) {
+        bitreader_refill(br);
+        usize first = decode_multi(dec, br, &out[i]);
+        usize second = first ? decode_multi(dec, br, &out[i + first]) : 0;
+        usize third = second ? decode_multi(dec, br, &out[i + first + second]) : 0;
+        ok = third != 0;
+        i += first + second + third;
+    }
 
-        io_write_u8_le(io, (u8)i);
-        io_write_u16_le(io, code.bits);
-        io_write_u8_le(io, code.bit_len);
+    for (; i + 3 <= len && ok; i += 3) {
+        bitreader_refill(br);
+        ok = decode_symbol(dec, br, &out[i]);
+        ok = ok && decode_symbol(dec, br, &out[i + 1]);
+        ok = ok && decode_symbol(dec, br, &out[i + 2]);
     }
 
-    usize compressed_worst_len = ((input->len * max_code_len) / 8) + 1;
-    struct buffer_u8 compressed;
-    buffer_alloc_z(&compressed, compressed_worst_len);
+    for (; i < len && ok; i++) {
+        bitreader_refill(br);
+        ok = decode_symbol(dec, br, &out[i]);
+    }
 
-    assert(compressed.data);
+    if (!ok) {
+        fprintf(stderr, "error: invalid code in compressed data, is the file ill formatted?\n");
+        return false;
+    }
 
-    struct bitstream bs = {
-        .data = compressed.data,
-        .capacity = compressed.len,
-        .byte_pos = 0,
-        .bit_pos = 0
-    };
+    if (bitreader_overrun(br)) {
+        fprintf(stderr, "error: unexpected end of compressed data\n");
+        return false;
+    }
+
+    return true;
+}
 
-    for (usize i = 0; i < input->len; i++) {
-        u8 symbol = input->data[i];
-        struct hcode code = code_map.data[symbol];
-        if (code.bit_len == 0) {
-            fprintf(stderr, "error: code for byte '0x%2x' was not generated\n",
-                symbol);
+// Decodes `len` symbols spread round-robin over `n` bitstreams: symbol i is in
+// stream i % n. The streams don't depend on each other, so the lookups of one
+// round overlap instead of waiting on the previous code's length.
+static inline bool decode_interleaved(const struct hdecoder* dec, struct bitreader* br, usize n, u8* out, usize len) {
+    usize i = 0;
+    bool ok = true;
 
-            buffer_free(&compressed);
-            return false;
+    for (; i + 3 * n <= len; i += 3 * n) {
+        for (usize k = 0; k < n; k++)
+            bitreader_refill(&br[k]);
+
+        for (usize round = 0; round < 3; round++) {
+            for (usize k = 0; k < n; k++)
+                ok &= decode_symbol(dec, &br[k], &out[i + round * n + k]);
         }
+    }
 
-        bitstream_write_bits(&bs, code.bits, code.bit_len);
+    for (; i < len; i++) {
+        bitreader_refill(&br[i % n]);
+        ok &= decode_symbol(dec, &br[i % n], &out[i]);
     }
 
-    io_write(io, bs.data, bs.byte_pos + (bs.bit_pos > 0 ? 1 : 0));
-    buffer_free(&compressed);
+    if (!ok) {
+        fprintf(stderr, "error: invalid code in compressed data, is the file ill formatted?\n");
+        return false;
+    }
+
+    for (usize k = 0; k < n; k++) {
+        if (bitreader_overrun(&br[k])) {
+            fprintf(stderr, "error: unexpected end of compressed data\n");
+            return false;
+        }
+    }
 
     return true;
 }
 
-struct buffer_u8 fformat_decompress(struct io_stream* io) {
-    struct buffer_u8 decompressed = { 0 };
+// Run-length coding ahead of the Huffman stage: once RLE_MIN_RUN equal bytes
+// were written, the next byte is how many more times (0..255) the byte repeats
+#define RLE_MIN_RUN 4
+#define RLE_MAX_RUN (RLE_MIN_RUN + 255)
 
-    // Read and compare file signature
-    u8 magic[countof(FILE_MAGIC)];
-    io_read(io, &magic, countof(FILE_MAGIC) * sizeof(u8));
+// The largest run-length coded size of `len` bytes
+static usize rle_bound(usize len) {
+    return len + len / RLE_MIN_RUN + 1;
+}
 
-    if (memcmp(magic, FILE_MAGIC, countof(FILE_MAGIC)) != 0) {
-        fprintf(stderr, "error: file magic does not match\n");
-        return decompressed;
+static usize rle_encode(const u8* in, usize len, u8* out) {
+    usize size = 0;
+    for (usize i = 0; i < len;) {
+        u8 c = in[i];
+        usize run = 1;
+        while (i + run < len && run < RLE_MAX_RUN && in[i + run] == c)
+            run++;
+
+        if (run >= RLE_MIN_RUN) {
+            memset(out + size, c, RLE_MIN_RUN);
+            out[size + RLE_MIN_RUN] = (u8)(run - RLE_MIN_RUN);
+            size += RLE_MIN_RUN + 1;
+        } else {
+            memset(out + size, c, run);
+            size += run;
+        }
+
+        i += run;
     }
 
-    u64 original_file_size = io_read_u64_le(io);
-    u32 offset_to_content = io_read_u32_le(io);
+    return size;
+}
+
+static bool rle_decode(const u8* in, usize len, u8* out, usize out_len) {
+    usize size = 0, run = 0;
+    bool ok = true;
 
-    // Count how many entries there are
-    usize entries_count = 0;
-    {
-        long current_position = io_tell(io);
-        entries_count = (offset_to_content - current_position) / HCODE_ENTRY_SIZE;
+    for (usize i = 0; i < len && ok; i++) {
+        u8 c = in[i];
+        run = run > 0 && out[size - 1] == c ? run + 1 : 1;
+
+        ok = size < out_len;
+        if (ok)
+            out[size++] = c;
+
+        if (ok && run == RLE_MIN_RUN) {
+            ok = i + 1 < len && in[i + 1] <= out_len - size;
+            if (ok) {
+                memset(out + size, c, in[++i]);
+                size += in[i];
+                run = 0;
+            }
+        }
     }
 
-    struct buffer_hcode code_map;
-    buffer_alloc_z(&code_map, UINT8_MAX);
-    if (!code_map.data) {
-        fprintf(stderr, "error: failed to allocate code map: %s", strerror(errno));
-        return decompressed;
+    if (!ok || size != out_len) {
+        fprintf(stderr, "error: run-length coded data doesn't match the block size, is the file ill formatted?\n");
+        return false;
     }
 
-    u8 max_code_len = 0;
-    for (usize i = 0; i < entries_count; i++) {
-        u8 symbol = io_read_u8_le(io);
-        struct hcode new_code = {
-            .bits = io_read_u16_le(io),
-            .bit_len = io_read_u8_le(io)
-        };
+    return true;
+}
+
+// Transformed blocks start with their coded size, Burrows-Wheeler coded ones
+// follow it with the row of the block among its sorted rotations
+static usize block_prefix(u8 flags) {
+    if (flags & BLOCK_FLAG_BWT)
+        return 2 * sizeof(u32);
+    return (flags & BLOCK_FLAG_RLE) ? sizeof(u32) : 0;
+}
+
+struct fformat_options fformat_default_options(void) {
+    // This needs to be here since clang-format fucks up the line above, because of stupid macro formatting
+    // clang-format on
+
+    struct fformat_options options = {
+        .block_size = FFORMAT_DEFAULT_BLOCK_SIZE,
+        .max_code_len = FFORMAT_MAX_CODE_LEN,
+        .threads = 1,
+        .streams = 1,
+        .sample_rate = 1,
+        .min_saving = 1,
+        .table_reuse = 1,
+    };
+
+    return options;
+}
+
+usize fformat_block_bound(usize block_size) {
+    // Every stream has a size (but the last) and may end with a padded byte
+    usize streams = FFORMAT_MAX_STREAMS * (sizeof(u32) + 1);
+    return BLOCK_HEADER_SIZE + ALPHABET_SIZE + streams + ((block_size * FFORMAT_MAX_CODE_LEN) / 8);
+}
+
+// The code tables of the last FFORMAT_TABLE_CACHE Huffman blocks, for repeat
+// blocks. Encoders and decoders push the same tables in the same order, so
+// they agree on which tables are cached.
+struct table_cache {
+    u64 blocks[FFORMAT_TABLE_CACHE]; // block number + 1, 0 for empty slots
+    struct hcode codes[FFORMAT_TABLE_CACHE][ALPHABET_SIZE];
+    usize next; // the slot replaced next
+};
+
+static void table_cache_push(struct table_cache* cache, u64 block, const struct hcode* codes) {
+    cache->blocks[cache->next] = block + 1;
+    memcpy(cache->codes[cache->next], codes, sizeof(cache->codes[0]));
+    cache->next = (cache->next + 1) % FFORMAT_TABLE_CACHE;
+}
+
+static const struct hcode* table_cache_find(const struct table_cache* cache, u64 block) {
+    for (usize i = 0; i < FFORMAT_TABLE_CACHE; i++) {
+        if (cache->blocks[i] == block + 1)
+            return cache->codes[i];
+    }
+
+    return NULL;
+}
 
-        if (new_code.bit_len > max_code_len) {
-            max_code_len = new_code.bit_len;
+// Stores the table of every context as runs, like code_lengths_pack, returns
+// the size in bytes
+static usize context_map_pack(const u8* map, u8* out) {
+    usize size = 0;
+    for (usize i = 0; i < ALPHABET_SIZE;) {
+        usize run = 1;
+        while (i + run < ALPHABET_SIZE && run < 16 && map[i + run] == map[i])
+            run++;
+
+        out[size++] = (u8)((map[i] << 4) | (run - 1));
+        i += run;
+    }
+
+    return size;
+}
+
+// Reads the context map stored by context_map_pack, returns how many bytes it
+// takes or 0 if it is ill formatted
+static usize context_map_unpack(const u8* data, usize len, usize tables, u8* map) {
+    usize size = 0;
+    for (usize i = 0; i < ALPHABET_SIZE;) {
+        if (size >= len) {
+            fprintf(stderr, "error: unexpected end of context map\n");
+            return 0;
+        }
+
+        u8 run = data[size++];
+        usize run_len = (run & 0xf) + 1;
+        if (i + run_len > ALPHABET_SIZE || (usize)(run >> 4) >= tables) {
+            fprintf(stderr, "error: context map is ill formatted\n");
+            return 0;
         }
 
-        code_map.data[symbol] = new_code;
+        memset(map + i, run >> 4, run_len);
+        i += run_len;
     }
 
-    usize compressed_size = 0;
-    {
-        io_seek(io, 0, SEEK_END);
-        unsigned long end = io_tell(io);
-        compressed_size = (end - offset_to_content);
+    return size;
+}
+
+// The tables of a context block, see Context Blocks in fformat.h
+struct context_model {
+    usize* freqs; // frequency map of every context, allocated when needed
+    u8 map[ALPHABET_SIZE]; // table of every context
+    usize tables;
+    usize table_freqs[FFORMAT_MAX_CONTEXT_TABLES][ALPHABET_SIZE];
+    struct hcode codes[FFORMAT_MAX_CONTEXT_TABLES][ALPHABET_SIZE];
+    // The payload up to the bitstream: table count, context map and tables
+    u8 header[1 + ALPHABET_SIZE + FFORMAT_MAX_CONTEXT_TABLES * ALPHABET_SIZE];
+    usize header_len;
+};
+
+// Scratch memory for compressing blocks, reused from one block to the next
+struct block_encoder {
+    struct htree tree;
+    struct hcode codes[ALPHABET_SIZE];
+    usize freqs[ALPHABET_SIZE]; // the ones the codes are built from
+    usize exact[ALPHABET_SIZE]; // counted from every byte, when `freqs` is a sample
+    struct buffer_u8 block;
+    struct buffer_u8 out;
+    struct buffer_u8 rle; // run-length coded block, allocated when needed
+    struct buffer_u8 bwt; // Burrows-Wheeler scratch memory, allocated when needed
+    usize hist_threads;   // threads counting the symbols of a block
+    bool reuse;           // when blocks are encoded in order, see table_reuse
+    u64 block_no;         // number of the next block
+    struct table_cache cache;
+    // How much larger than the entropy each cached table made its own block,
+    // what a new table is expected to cost a block
+    double overhead[FFORMAT_TABLE_CACHE];
+    struct context_model context; // when options->context is set
+};
+
+// Blocks read straight from memory don't need a block buffer
+static bool block_encoder_init(struct block_encoder* enc, usize block_size, bool own_block) {
+    if (own_block)
+        buffer_alloc(&enc->block, block_size);
+    buffer_alloc(&enc->out, fformat_block_bound(block_size));
+    if ((own_block && !enc->block.data) || !enc->out.data) {
+        fprintf(stderr, "error: failed to allocate block buffers: %s\n", strerror(errno));
+        buffer_free(&enc->block);
+        buffer_free(&enc->out);
+        return false;
     }
 
-    struct buffer_u8 compressed_data;
-    buffer_alloc(&compressed_data, compressed_size);
-    if (!compressed_data.data) {
-        fprintf(stderr, "error: failed to allocate compressed data: %s\n", strerror(errno));
-        buffer_free(&code_map);
-        return decompressed;
+    return true;
+}
+
+static void block_encoder_free(struct block_encoder* enc) {
+    buffer_free(&enc->block);
+    buffer_free(&enc->out);
+    buffer_free(&enc->rle);
+    buffer_free(&enc->bwt);
+    free(enc->context.freqs);
+}
+
+// Builds canonical codes no longer than `max_len` bits for `freqs` into
+// `code_map`. When `unlimited_bits` is set, it gets the cost of the codes before
+// the limit, measured against `actual`.
+static bool build_codes(struct htree* tree, struct buffer_usize freqs, u8 max_len, struct buffer_hcode* code_map,
+    struct buffer_usize actual, u64* unlimited_bits) {
+    memset(code_map->data, 0, code_map->len * sizeof(struct hcode));
+
+    struct pqueue queue = pqueue_build(tree, freqs);
+    struct helement* root = htree_build(tree, &queue);
+    htree_encode(root, code_map, 0, 0);
+
+    // A lone symbol is the root of its tree and gets an empty code, give it a bit
+    if (root && !root->left && !root->right)
+        code_map->data[root->byte].bit_len = 1;
+
+    if (unlimited_bits)
+        *unlimited_bits = hcode_cost(actual, *code_map);
+
+    return hcode_limit(freqs, code_map, max_len) && hcode_canonical(code_map);
+}
+
+// Counts the symbols of a block into enc->freqs, or estimates them from a
+// sample. The stats measure the codes against the exact frequencies, which
+// takes counting sampled blocks once more into enc->exact, while they are
+// still in cache.
+static bool block_count(struct block_encoder* enc, const struct fformat_options* options, struct buffer_u8 block, bool stats) {
+    if (options->sample_rate == 1)
+        return frequencies_count_parallel(&block, enc->hist_threads, enc->freqs);
+
+    frequencies_sample(&block, options->sample_rate, enc->freqs);
+    if (stats)
+        frequencies_count(&block, enc->exact);
+    return true;
+}
+
+// Builds the code table of a block from the frequencies block_count found, and
+// estimates the size of the encoded block in `estimate_bits`
+static bool block_codes(struct block_encoder* enc, const struct fformat_options* options, struct buffer_hcode* code_map,
+    struct fformat_stats* stats, u64* estimate_bits) {
+    bool sampled = options->sample_rate > 1;
+    struct buffer_usize freqs = { .data = enc->freqs, .len = ALPHABET_SIZE };
+
+    if (!stats) {
+        bool ok = build_codes(&enc->tree, freqs, options->max_code_len, code_map, freqs, NULL);
+        *estimate_bits = hcode_cost(freqs, *code_map);
+        return ok;
     }
 
-    io_seek(io, offset_to_content, SEEK_SET);
-    io_read(io, compressed_data.data, compressed_size * sizeof(u8));
+    struct buffer_usize exact = freqs;
+    if (sampled)
+        exact.data = enc->exact;
 
-    buffer_alloc(&decompressed, original_file_size);
-    if (!decompressed.data) {
-        fprintf(stderr, "error: failed to allocate decompressed data: %s\n", strerror(errno));
-        buffer_free(&code_map);
-        buffer_free(&compressed_data);
-        return decompressed;
+    u64 unlimited_bits = 0;
+    bool ok = build_codes(&enc->tree, freqs, options->max_code_len, code_map, exact, &unlimited_bits);
+
+    if (ok) {
+        u64 content_bits = hcode_cost(exact, *code_map);
+        u64 exact_bits = content_bits;
+        *estimate_bits = hcode_cost(freqs, *code_map);
+
+        if (sampled) {
+            struct hcode exact_codes[ALPHABET_SIZE];
+            struct buffer_hcode exact_map = { .data = exact_codes, .len = ALPHABET_SIZE };
+            ok = build_codes(&enc->tree, exact, options->max_code_len, &exact_map, exact, NULL);
+            exact_bits = hcode_cost(exact, exact_map);
+        }
+
+        stats->content_bits += content_bits;
+        stats->unlimited_bits += unlimited_bits;
+        stats->exact_bits += exact_bits;
     }
 
-    u16 current_bits = 0;
-    u8 current_len = 0;
-    usize output_pos = 0;
+    return ok;
+}
 
-    struct bitstream bs = {
-        .data = compressed_data.data,
-        .capacity = compressed_data.len,
-        .byte_pos = 0,
-        .bit_pos = 0
-    };
+// Finds the cached table that codes the block in the fewest bits, as long as
+// that is within options->table_reuse percent of what a table of its own is
+// expected to cost. Tables missing a code for a symbol of the block can't be used.
+static const struct hcode* reusable_codes(struct block_encoder* enc, const struct fformat_options* options, u64 entropy, u64* source, u64* bits) {
+    struct buffer_usize freqs = { .data = enc->freqs, .len = ALPHABET_SIZE };
+    const struct hcode* best = NULL;
 
-    while (output_pos < decompressed.len) {
-        u8 bit;
-        if (!bitstream_read_bit(&bs, &bit)) {
-            fprintf(stderr, "error: unexpected end of compressed data\n");
-            buffer_free(&code_map);
-            buffer_free(&compressed_data);
-            buffer_free(&decompressed);
-            return decompressed;
+    for (usize i = 0; i < FFORMAT_TABLE_CACHE; i++) {
+        if (!enc->cache.blocks[i])
+            continue;
+
+        const struct hcode* codes = enc->cache.codes[i];
+        u64 cost = 0;
+        bool usable = true;
+        for (usize c = 0; c < ALPHABET_SIZE && usable; c++) {
+            usable = codes[c].bit_len || !freqs.data[c];
+            cost += (u64)freqs.data[c] * codes[c].bit_len;
+        }
+
+        double limit = entropy * enc->overhead[i] * (100 + options->table_reuse) / 100;
+        if (usable && cost <= limit && (!best || cost < *bits)) {
+            best = codes;
+            *source = enc->cache.blocks[i] - 1;
+            *bits = cost;
+        }
+    }
+
+    return best;
+}
+
+// A new table is only worth it when it saves about what storing it costs
+#define CONTEXT_TABLE_BITS (64 * 8)
+#define CONTEXT_ROUNDS 4
+
+// Smaller blocks can't make up for the tables of a context block
+#define CONTEXT_MIN_SYMBOLS (4 << 10)
+
+// Context blocks split their symbols in one part per stream, part k of `len`
+// symbols starts at symbol k * len / streams
+static usize context_part(usize len, usize streams, usize k) {
+    return (usize)((u64)k * len / streams);
+}
+
+// Cost in 1/65536 bits of coding a context with the costs of a table
+static u64 context_cost(const usize* freqs, const u32* costs) {
+    u64 cost = 0;
+    for (usize s = 0; s < ALPHABET_SIZE; s++)
+        cost += (u64)freqs[s] * costs[s];
+    return cost;
+}
+
+// Clusters the contexts into model->map. The busiest context seeds the first
+// table and the context the tables so far code worst, compared to its own
+// statistics, seeds the next one. Contexts then move to the table that codes
+// them best for a few rounds.
+static void context_cluster(struct context_model* model) {
+    u32 costs[FFORMAT_MAX_CONTEXT_TABLES][ALPHABET_SIZE];
+    usize totals[ALPHABET_SIZE] = { 0 };
+    u64 own[ALPHABET_SIZE], best[ALPHABET_SIZE];
+
+    usize seed = 0;
+    for (usize c = 0; c < ALPHABET_SIZE; c++) {
+        const usize* freqs = model->freqs + c * ALPHABET_SIZE;
+        for (usize s = 0; s < ALPHABET_SIZE; s++)
+            totals[c] += freqs[s];
+
+        if (totals[c] > totals[seed])
+            seed = c;
+
+        if (totals[c]) {
+            frequencies_costs((struct buffer_usize) { .data = (usize*)freqs, .len = ALPHABET_SIZE }, costs[0]);
+            own[c] = context_cost(freqs, costs[0]);
+            best[c] = UINT64_MAX;
+        }
+    }
+
+    memset(model->map, 0, sizeof(model->map));
+    usize tables = 0;
+    while (tables < FFORMAT_MAX_CONTEXT_TABLES) {
+        struct buffer_usize table = { .data = model->table_freqs[tables], .len = ALPHABET_SIZE };
+        memcpy(table.data, model->freqs + seed * ALPHABET_SIZE, sizeof(model->table_freqs[0]));
+        frequencies_costs(table, costs[tables]);
+
+        u64 worst = (u64)CONTEXT_TABLE_BITS << 16;
+        bool found = false;
+        for (usize c = 0; c < ALPHABET_SIZE; c++) {
+            if (!totals[c])
+                continue;
+
+            u64 cost = context_cost(model->freqs + c * ALPHABET_SIZE, costs[tables]);
+            if (cost < best[c]) {
+                best[c] = cost;
+                model->map[c] = (u8)tables;
+            }
+
+            if (best[c] > own[c] && best[c] - own[c] > worst) {
+                worst = best[c] - own[c];
+                seed = c;
+                found = true;
+            }
+        }
+
+        tables++;
+        if (!found)
+            break;
+    }
+
+    usize table_totals[FFORMAT_MAX_CONTEXT_TABLES];
+    for (usize round = 0;; round++) {
+        memset(model->table_freqs, 0, sizeof(model->table_freqs));
+        memset(table_totals, 0, sizeof(table_totals));
+        for (usize c = 0; c < ALPHABET_SIZE; c++) {
+            const usize* freqs = model->freqs + c * ALPHABET_SIZE;
+            usize* table = model->table_freqs[model->map[c]];
+            for (usize s = 0; s < ALPHABET_SIZE; s++)
+                table[s] += freqs[s];
+            table_totals[model->map[c]] += totals[c];
         }
 
-        current_bits = (current_bits << 1) | bit;
-        current_len++;
+        if (round == CONTEXT_ROUNDS)
+            break;
 
-        for (usize sym = 0; sym < code_map.len; sym++) {
-            struct hcode code = code_map.data[sym];
-            if (code.bit_len == 0)
+        for (usize t = 0; t < tables; t++)
+            frequencies_costs((struct buffer_usize) { .data = model->table_freqs[t], .len = ALPHABET_SIZE }, costs[t]);
+
+        // Tables left without contexts would code anything for free
+        bool moved = false;
+        for (usize c = 0; c < ALPHABET_SIZE; c++) {
+            if (!totals[c])
                 continue;
 
-            if (code.bit_len == current_len) {
-                u16 mask = (1 << current_len) - 1;
-                u16 aligned_input = current_bits & mask;
-                if (aligned_input == code.bits) {
-                    decompressed.data[output_pos++] = (u8)sym;
-                    current_bits = 0;
-                    current_len = 0;
-                    break;
+            u8 table = model->map[c];
+            u64 cost = context_cost(model->freqs + c * ALPHABET_SIZE, costs[table]);
+            for (usize t = 0; t < tables; t++) {
+                u64 other = table_totals[t] ? context_cost(model->freqs + c * ALPHABET_SIZE, costs[t]) : UINT64_MAX;
+                if (other < cost) {
+                    cost = other;
+                    table = (u8)t;
                 }
             }
+
+            moved |= table != model->map[c];
+            model->map[c] = table;
         }
 
-        if (current_len > 16) {
-            fprintf(stderr, "error: caught infinite loop while decompressing, is the file ill formatted?\n");
-            buffer_free(&code_map);
-            buffer_free(&compressed_data);
-            buffer_free(&decompressed);
-            return decompressed;
+        if (!moved)
+            break;
+    }
+
+    // Drops the tables that were left without contexts
+    u8 renumber[FFORMAT_MAX_CONTEXT_TABLES];
+    model->tables = 0;
+    for (usize t = 0; t < tables; t++) {
+        renumber[t] = (u8)model->tables;
+        if (table_totals[t]) {
+            if (model->tables != t)
+                memcpy(model->table_freqs[model->tables], model->table_freqs[t], sizeof(model->table_freqs[0]));
+            model->tables++;
         }
     }
 
-    buffer_free(&code_map);
-    buffer_free(&compressed_data);
+    for (usize c = 0; c < ALPHABET_SIZE; c++)
+        model->map[c] = totals[c] ? renumber[model->map[c]] : 0;
+}
+
+// Counts and clusters the contexts of `symbols`, then builds the table of
+// every cluster and packs them into model->header. `bits` gets the size of the
+// coded symbols.
+static bool context_build(struct block_encoder* enc, const struct fformat_options* options, struct buffer_u8 symbols, usize streams, u64* bits) {
+    struct context_model* model = &enc->context;
+    if (!model->freqs) {
+        model->freqs = malloc(ALPHABET_SIZE * ALPHABET_SIZE * sizeof(usize));
+        if (!model->freqs) {
+            fprintf(stderr, "error: failed to allocate context frequencies: %s\n", strerror(errno));
+            return false;
+        }
+    }
+
+    // Every part starts over from context 0
+    STATS_BEGIN(count_timer);
+    memset(model->freqs, 0, ALPHABET_SIZE * ALPHABET_SIZE * sizeof(usize));
+    for (usize k = 0; k < streams; k++) {
+        usize start = context_part(symbols.len, streams, k);
+        struct buffer_u8 part = { .data = symbols.data + start, .len = context_part(symbols.len, streams, k + 1) - start };
+        frequencies_add_order1(&part, model->freqs);
+    }
+    STATS_END(STATS_FREQUENCIES, count_timer);
+
+    STATS_BEGIN(tree_timer);
+    context_cluster(model);
+
+    model->header[0] = (u8)model->tables;
+    model->header_len = 1 + context_map_pack(model->map, model->header + 1);
+    *bits = 0;
+    for (usize t = 0; t < model->tables; t++) {
+        struct buffer_usize freqs = { .data = model->table_freqs[t], .len = ALPHABET_SIZE };
+        struct buffer_hcode code_map = { .data = model->codes[t], .len = ALPHABET_SIZE };
+        if (!build_codes(&enc->tree, freqs, options->max_code_len, &code_map, freqs, NULL))
+            return false;
+
+        *bits += hcode_cost(freqs, code_map);
+        model->header_len += code_lengths_pack(code_map, model->header + model->header_len);
+    }
+    STATS_END(STATS_TREE, tree_timer);
+
+    return true;
+}
+
+static usize store_block(struct block_encoder* enc, struct buffer_u8 block, struct fformat_stats* stats) {
+    u8* header = enc->out.data;
+    header[0] = BLOCK_STORED;
+    header[1] = 0;
+    store_u32_le(header + 2, (u32)block.len);
+    store_u32_le(header + 6, (u32)block.len);
+    memcpy(header + BLOCK_HEADER_SIZE, block.data, block.len);
+
+    if (stats)
+        stats->stored_blocks++;
+
+    return BLOCK_HEADER_SIZE + block.len;
+}
+
+static bool is_single_symbol(struct buffer_u8 block) {
+    u64 pattern = block.data[0] * 0x0101010101010101ull;
+    usize i = 0;
+    for (; i + 8 <= block.len; i += 8) {
+        u64 word;
+        memcpy(&word, block.data + i, sizeof(word));
+        if (word != pattern)
+            return false;
+    }
+
+    for (; i < block.len; i++) {
+        if (block.data[i] != block.data[0])
+            return false;
+    }
+
+    return true;
+}
 
-    return decompressed;
+static usize single_block(struct block_encoder* enc, struct buffer_u8 block) {
+    u8* header = enc->out.data;
+    header[0] = BLOCK_SINGLE;
+    header[1] = 0;
+    store_u32_le(header + 2, (u32)block.len);
+    store_u32_le(header + 6, 1);
+    header[BLOCK_HEADER_SIZE] = block.data[0];
+
+    return BLOCK_HEADER_SIZE + 1;
 }
 
-void bitstream_write_bits(struct bitstream* bs, u16 bits, u8 bit_len) {
-    while (bit_len--) {
-        u8 bit = (bits >> bit_len) & 1;
-        bs->data[bs->byte_pos] |= (bit << (7 - bs->bit_pos));
-        bs->bit_pos++;
+// Codes `symbols` in `streams` interleaved bitstreams, stored one after the
+// other and preceded by the size of all of them but the last. Returns how many
+// bytes were written to `out`.
+static usize write_streams(struct buffer_hcode code_map, struct buffer_u8 symbols, usize streams, u8* out, usize capacity) {
+    STATS_BEGIN(timer);
+    usize len = (streams - 1) * sizeof(u32);
 
-        if (bs->bit_pos == 8) {
-            bs->bit_pos = 0;
-            bs->byte_pos++;
-            bs->data[bs->byte_pos] = 0;
+    for (usize k = 0; k < streams; k++) {
+        struct bitwriter bw = bitwriter_make(out + len, capacity - len);
+        for (usize i = k; i < symbols.len; i += streams) {
+            struct hcode code = code_map.data[symbols.data[i]];
+            bitwriter_put(&bw, code.bits, code.bit_len);
         }
+
+        usize stream_len = bitwriter_finish(&bw);
+        if (k < streams - 1)
+            store_u32_le(out + k * sizeof(u32), (u32)stream_len);
+        len += stream_len;
     }
+
+    STATS_END(STATS_ENCODE, timer);
+    STATS_CODES(code_map, symbols.data, symbols.len);
+    return len;
 }
 
-bool bitstream_read_bit(struct bitstream* bs, u8* out_bit) {
-    if (bs->byte_pos >= bs->capacity)
-        return false;
+// Codes a block with the static table. There are no frequencies to estimate
+// its size from, so the block is coded first and stored if that didn't pay off.
+static usize static_block(struct block_encoder* enc, const struct fformat_options* options, struct buffer_u8 block,
+    struct buffer_u8 symbols, u8 transform, struct fformat_stats* stats) {
+    usize prefix = block_prefix(transform);
+    u8* header = enc->out.data;
+    u8* payload = header + BLOCK_HEADER_SIZE;
+    usize streams = options->streams;
+
+    struct buffer_hcode code_map = { .data = (struct hcode*)options->table->codes, .len = ALPHABET_SIZE };
+    usize payload_len = prefix + write_streams(code_map, symbols, streams, payload + prefix, enc->out.len - BLOCK_HEADER_SIZE - prefix);
+    if (payload_len + block.len * options->min_saving / 100 >= block.len)
+        return store_block(enc, block, stats);
+
+    // The table is the same for every block, so it has no cost to compare to
+    if (stats) {
+        u64 bits = 8 * (u64)(payload_len - prefix - (streams - 1) * sizeof(u32));
+        stats->content_bits += bits;
+        stats->unlimited_bits += bits;
+        stats->exact_bits += bits;
+    }
+
+    header[0] = BLOCK_STATIC;
+    header[1] = (u8)((streams - 1) | transform);
+    store_u32_le(header + 2, (u32)block.len);
+    store_u32_le(header + 6, (u32)payload_len);
+
+    return BLOCK_HEADER_SIZE + payload_len;
+}
+
+// Codes every symbol with the table of the symbol before it, each part of the
+// symbols in a stream of its own, stored like the ones of write_streams.
+// Returns how many bytes were written to `out`.
+static usize write_context_streams(const struct context_model* model, struct buffer_u8 symbols, usize streams, u8* out, usize capacity) {
+    STATS_BEGIN(timer);
+    const struct hcode* by_context[ALPHABET_SIZE];
+    for (usize c = 0; c < ALPHABET_SIZE; c++)
+        by_context[c] = model->codes[model->map[c]];
+
+    usize len = (streams - 1) * sizeof(u32);
+    for (usize k = 0; k < streams; k++) {
+        struct bitwriter bw = bitwriter_make(out + len, capacity - len);
+        u8 prev = 0;
+        for (usize i = context_part(symbols.len, streams, k); i < context_part(symbols.len, streams, k + 1); i++) {
+            struct hcode code = by_context[prev][symbols.data[i]];
+            bitwriter_put(&bw, code.bits, code.bit_len);
+            prev = symbols.data[i];
+        }
+
+        usize stream_len = bitwriter_finish(&bw);
+        if (k < streams - 1)
+            store_u32_le(out + k * sizeof(u32), (u32)stream_len);
+        len += stream_len;
+    }
+
+    STATS_END(STATS_ENCODE, timer);
+
+#if HF_STATS
+    for (usize t = 0; t < model->tables; t++) {
+        struct buffer_hcode code_map = { .data = (struct hcode*)model->codes[t], .len = ALPHABET_SIZE };
+        struct buffer_usize freqs = { .data = (usize*)model->table_freqs[t], .len = ALPHABET_SIZE };
+        STATS_FREQS(code_map, freqs);
+    }
+#endif
+
+    return len;
+}
+
+// Codes a block with the tables context_build made, `bits` is what its
+// symbols take
+static usize context_block(struct block_encoder* enc, const struct fformat_options* options, struct buffer_u8 block,
+    struct buffer_u8 symbols, u8 transform, u64 bits, struct fformat_stats* stats) {
+    const struct context_model* model = &enc->context;
+    usize prefix = block_prefix(transform);
+    usize streams = options->streams;
+    usize offset = prefix + model->header_len;
+    usize estimate = offset + (streams - 1) * sizeof(u32) + (usize)((bits + 7) / 8);
+    if (estimate + block.len * options->min_saving / 100 >= block.len)
+        return store_block(enc, block, stats);
+
+    u8* header = enc->out.data;
+    u8* payload = header + BLOCK_HEADER_SIZE;
+    memcpy(payload + prefix, model->header, model->header_len);
+    usize payload_len = offset + write_context_streams(model, symbols, streams, payload + offset, enc->out.len - BLOCK_HEADER_SIZE - offset);
+
+    if (stats) {
+        stats->content_bits += bits;
+        stats->unlimited_bits += bits;
+        stats->exact_bits += bits;
+        stats->context_blocks++;
+        stats->bwt_blocks += (transform & BLOCK_FLAG_BWT) != 0;
+    }
+
+    header[0] = BLOCK_CONTEXT;
+    header[1] = (u8)((streams - 1) | transform);
+    store_u32_le(header + 2, (u32)block.len);
+    store_u32_le(header + 6, (u32)payload_len);
+
+    return BLOCK_HEADER_SIZE + payload_len;
+}
+
+// Smaller blocks lose more to the table of their move-to-front positions than
+// the transform saves
+#define BWT_MIN_SIZE 512
+
+// Burrows-Wheeler codes `block` into enc->bwt, and makes it the symbols of the
+// block when that lowers their entropy. The Huffman stage can't go below the
+// entropy, so that tells whether the transform pays off without coding twice.
+static bool block_bwt(struct block_encoder* enc, struct buffer_u8 block, struct buffer_u8* symbols, u32* origin) {
+    usize scratch = bwt_encode_scratch(block.len);
+    if (enc->bwt.len < scratch) {
+        buffer_free(&enc->bwt);
+        buffer_alloc(&enc->bwt, scratch);
+        if (!enc->bwt.data) {
+            fprintf(stderr, "error: failed to allocate Burrows-Wheeler buffer: %s\n", strerror(errno));
+            return false;
+        }
+    }
+
+    STATS_BEGIN(timer);
+    struct buffer_u8 coded = { .data = enc->bwt.data };
+    coded.len = bwt_encode(block.data, block.len, enc->bwt.data, origin);
+    STATS_END(STATS_TRANSFORM, timer);
+
+    usize freqs[ALPHABET_SIZE];
+    struct buffer_usize map = { .data = freqs, .len = ALPHABET_SIZE };
+    frequencies_count(&block, freqs);
+    u64 block_bits = frequencies_entropy(map);
+    frequencies_count(&coded, freqs);
+    if (frequencies_entropy(map) + 8 * block_prefix(BLOCK_FLAG_BWT) < block_bits)
+        *symbols = coded;
+
+    return true;
+}
+
+// Compresses `block` into enc->out, returns the size of the compressed block or
+// 0 on failure
+static usize encode_block(struct block_encoder* enc, const struct fformat_options* options, struct buffer_u8 block, struct fformat_stats* stats) {
+    u64 block_no = enc->block_no++;
+
+    // Mismatches are found within the first bytes of most blocks, so this is
+    // only a pass over the blocks it pays off for
+    if (is_single_symbol(block))
+        return single_block(enc, block);
+
+    // The Burrows-Wheeler transform groups bytes that come before the same
+    // strings, which makes the bytes that follow move-to-front mostly small.
+    // Static tables are trained on plain bytes, so they don't get it.
+    struct buffer_u8 symbols = block;
+    u32 origin = 0;
+    if (options->bwt && !options->table && block.len >= BWT_MIN_SIZE && !block_bwt(enc, block, &symbols, &origin))
+        return 0;
+
+    // Long runs are shortened ahead of the Huffman stage, when that makes the
+    // block smaller
+    if (options->rle && symbols.data == block.data) {
+        if (enc->rle.len < rle_bound(block.len)) {
+            buffer_free(&enc->rle);
+            buffer_alloc(&enc->rle, rle_bound(block.len));
+            if (!enc->rle.data) {
+                fprintf(stderr, "error: failed to allocate run-length buffer: %s\n", strerror(errno));
+                return 0;
+            }
+        }
+
+        usize rle_len = rle_encode(block.data, block.len, enc->rle.data);
+        if (rle_len < block.len)
+            symbols = (struct buffer_u8) { .data = enc->rle.data, .len = rle_len };
+    }
+
+    u8 transform = 0;
+    if (symbols.data != block.data)
+        transform = symbols.data == enc->bwt.data ? BLOCK_FLAG_BWT : BLOCK_FLAG_RLE;
 
-    u8 byte = bs->data[bs->byte_pos];
-    *out_bit = (byte >> (7 - bs->bit_pos)) & 1;
+    // Transformed blocks start with the number of coded symbols
+    u8* header = enc->out.data;
+    u8* payload = header + BLOCK_HEADER_SIZE;
+    usize prefix = block_prefix(transform);
+    if (transform)
+        store_u32_le(payload, (u32)symbols.len);
+    if (transform & BLOCK_FLAG_BWT)
+        store_u32_le(payload + sizeof(u32), origin);
 
-    bs->bit_pos++;
-    if (bs->bit_pos == 8) {
-        bs->bit_pos = 0;
-        bs->byte_pos++;
+    if (options->table)
+        return static_block(enc, options, block, symbols, transform, stats);
+
+    STATS_BEGIN(count_timer);
+    if (!block_count(enc, options, symbols, stats != NULL))
+        return 0;
+    STATS_END(STATS_FREQUENCIES, count_timer);
+
+    // A recent table that codes the block about as well as its own would is
+    // reused, which skips building one and storing it
+    struct buffer_hcode code_map = { .data = enc->codes, .len = ALPHABET_SIZE };
+    struct fformat_stats block_stats = { 0 };
+    STATS_BEGIN(tree_timer);
+    u64 estimate_bits = 0, source = 0, entropy = 0;
+    const struct hcode* reused = NULL;
+    if (enc->reuse) {
+        entropy = frequencies_entropy((struct buffer_usize) { .data = enc->freqs, .len = ALPHABET_SIZE });
+        reused = reusable_codes(enc, options, entropy, &source, &estimate_bits);
+    }
+
+    usize table_size;
+    if (reused) {
+        code_map.data = (struct hcode*)reused;
+        store_u32_le(payload + prefix, (u32)(block_no - source));
+        table_size = prefix + sizeof(u32);
+
+        if (stats) {
+            struct buffer_usize exact = { .data = options->sample_rate > 1 ? enc->exact : enc->freqs, .len = ALPHABET_SIZE };
+            u64 bits = hcode_cost(exact, code_map);
+            block_stats = (struct fformat_stats) { .content_bits = bits, .unlimited_bits = bits, .exact_bits = bits };
+        }
+    } else {
+        if (!block_codes(enc, options, &code_map, stats ? &block_stats : NULL, &estimate_bits))
+            return 0;
+        table_size = prefix + code_lengths_pack(code_map, payload + prefix);
+    }
+    STATS_END(STATS_TREE, tree_timer);
+
+    usize streams = options->streams;
+    usize estimate = table_size + (streams - 1) * sizeof(u32) + (usize)((estimate_bits + 7) / 8);
+
+    // Context blocks are used when they make up for their larger tables, like
+    // in text and logs, where the byte before says a lot about the next one
+    if (options->context && symbols.len >= CONTEXT_MIN_SYMBOLS) {
+        u64 context_bits;
+        if (!context_build(enc, options, symbols, streams, &context_bits))
+            return 0;
+        if (prefix + enc->context.header_len + (usize)((context_bits + 7) / 8) < table_size + (usize)((estimate_bits + 7) / 8))
+            return context_block(enc, options, block, symbols, transform, context_bits, stats);
+    }
+
+    // Blocks that wouldn't get at least min_saving percent smaller are stored
+    // as they are, which also makes them a plain copy to decompress
+    if (estimate + block.len * options->min_saving / 100 >= block.len)
+        return store_block(enc, block, stats);
+
+    if (stats) {
+        stats->content_bits += block_stats.content_bits;
+        stats->unlimited_bits += block_stats.unlimited_bits;
+        stats->exact_bits += block_stats.exact_bits;
+        stats->reused_blocks += reused != NULL;
+        stats->bwt_blocks += (transform & BLOCK_FLAG_BWT) != 0;
+    }
+
+    usize payload_len = table_size + write_streams(code_map, symbols, streams, payload + table_size, enc->out.len - BLOCK_HEADER_SIZE - table_size);
+
+    if (enc->reuse && !reused) {
+        enc->overhead[enc->cache.next] = entropy ? (double)estimate_bits / entropy : 1;
+        table_cache_push(&enc->cache, block_no, code_map.data);
+    }
+
+    header[0] = reused ? BLOCK_REPEAT : BLOCK_HUFFMAN;
+    header[1] = (u8)((streams - 1) | transform);
+    store_u32_le(header + 2, (u32)block.len);
+    store_u32_le(header + 6, (u32)payload_len);
+
+    return BLOCK_HEADER_SIZE + payload_len;
+}
+
+// Reads until `size` bytes were read or the stream ends
+static usize read_full(struct io_stream* io, u8* buffer, usize size) {
+    usize total = 0;
+    while (total < size) {
+        usize n = io_read(io, buffer + total, size - total);
+        if (n == 0)
+            break;
+        total += n;
+    }
+
+    return total;
+}
+
+static bool write_full(struct io_stream* io, const u8* buffer, usize size) {
+    if (io_write(io, (void*)buffer, size) != size) {
+        fprintf(stderr, "error: failed to write compressed data: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool index_push(struct fformat_index* index, usize* capacity, struct fformat_block entry) {
+    if (index->len == *capacity) {
+        usize new_capacity = *capacity ? *capacity * 2 : 64;
+        struct fformat_block* data = realloc(index->data, new_capacity * sizeof(struct fformat_block));
+        if (!data) {
+            fprintf(stderr, "error: failed to allocate block index: %s\n", strerror(errno));
+            return false;
+        }
+
+        index->data = data;
+        *capacity = new_capacity;
+    }
+
+    index->data[index->len++] = entry;
+    return true;
+}
+
+// The end block carries the block index followed by its trailer
+static void store_index_entry(u8* p, struct fformat_block entry) {
+    store_u64_le(p, entry.offset);
+    store_u64_le(p + 8, entry.raw_offset);
+    store_u32_le(p + 16, entry.raw_len);
+    store_u32_le(p + 20, entry.size);
+}
+
+static bool write_end_block(struct io_stream* out, struct fformat_index* index) {
+    usize payload_len = index->len * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE;
+    struct buffer_u8 end;
+    buffer_alloc(&end, BLOCK_HEADER_SIZE + payload_len);
+    if (!end.data) {
+        fprintf(stderr, "error: failed to allocate block index: %s\n", strerror(errno));
+        return false;
+    }
+
+    u8* p = end.data;
+    p[0] = BLOCK_END;
+    p[1] = 0;
+    store_u32_le(p + 2, 0);
+    store_u32_le(p + 6, (u32)payload_len);
+    p += BLOCK_HEADER_SIZE;
+
+    for (usize i = 0; i < index->len; i++) {
+        store_index_entry(p, index->data[i]);
+        p += INDEX_ENTRY_SIZE;
+    }
+
+    store_u64_le(p, index->len);
+    memcpy(p + sizeof(u64), INDEX_MAGIC, countof(INDEX_MAGIC));
+
+    bool ok = write_full(out, end.data, end.len);
+    buffer_free(&end);
+    return ok;
+}
+
+// A block on its way through the compressor. Jobs are used as a ring: blocks are
+// read into the next free job, encoded on the pool and written in order.
+struct compress_job {
+    struct pool_task task;
+    const struct fformat_options* options;
+    struct block_encoder enc;
+    struct buffer_u8 block;
+    usize size;
+    struct fformat_stats stats;
+};
+
+static void compress_job_run(void* arg) {
+    struct compress_job* job = arg;
+    job->size = encode_block(&job->enc, job->options, job->block, &job->stats);
+}
+
+// Where blocks are read from: straight from memory when `data` is set,
+// otherwise through `io`
+struct block_source {
+    struct io_stream* io;
+    const u8* data;
+    usize len;
+    usize pos;
+};
+
+// Returns the next block of the source, only copying it into `scratch` when
+// reading from a stream. The block is empty at the end of the source.
+static struct buffer_u8 source_next(struct block_source* src, struct buffer_u8 scratch, usize block_size) {
+    struct buffer_u8 block = { 0 };
+    if (src->data) {
+        block.data = (u8*)src->data + src->pos;
+        block.len = src->len - src->pos < block_size ? src->len - src->pos : block_size;
+        src->pos += block.len;
+    } else {
+        STATS_BEGIN(timer);
+        block.data = scratch.data;
+        block.len = read_full(src->io, scratch.data, block_size);
+        STATS_END(STATS_READ, timer);
+    }
+
+    return block;
+}
+
+static bool options_check(const struct fformat_options* options) {
+    if (options->block_size < FFORMAT_MIN_BLOCK_SIZE || options->block_size > FFORMAT_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "error: block size must be between %d and %d bytes\n", FFORMAT_MIN_BLOCK_SIZE, FFORMAT_MAX_BLOCK_SIZE);
+        return false;
+    }
+
+    if (options->max_code_len < 8 || options->max_code_len > FFORMAT_MAX_CODE_LEN) {
+        fprintf(stderr, "error: code length limit must be between 8 and %d bits\n", FFORMAT_MAX_CODE_LEN);
+        return false;
+    }
+
+    if (options->threads < 1 || options->threads > FFORMAT_MAX_THREADS) {
+        fprintf(stderr, "error: thread count must be between 1 and %d\n", FFORMAT_MAX_THREADS);
+        return false;
+    }
+
+    if (options->streams != 1 && options->streams != 4 && options->streams != 8) {
+        fprintf(stderr, "error: interleaved stream count must be 1, 4 or 8\n");
+        return false;
+    }
+
+    if (options->min_saving > 100) {
+        fprintf(stderr, "error: minimum saving must be between 0 and 100 percent\n");
+        return false;
+    }
+
+    if (options->sample_rate < 1 || options->sample_rate > FFORMAT_MAX_SAMPLE_RATE) {
+        fprintf(stderr, "error: sample rate must be between 1 and %d\n", FFORMAT_MAX_SAMPLE_RATE);
+        return false;
+    }
+
+    return true;
+}
+
+static bool compress_blocks(struct io_stream* out, struct block_source* src, const struct fformat_options* options, struct fformat_stats* stats) {
+    if (!options_check(options))
+        return false;
+
+    // Two blocks per thread keep every worker busy while the oldest block is
+    // being written, and cap memory to a fixed number of blocks
+    usize job_count = options->threads > 1 ? 2 * options->threads : 1;
+    struct compress_job* jobs = calloc(job_count, sizeof(struct compress_job));
+    if (!jobs) {
+        fprintf(stderr, "error: failed to allocate block encoders: %s\n", strerror(errno));
+        return false;
+    }
+
+    // Threads only get a block each when there are several of them. An input
+    // that fits in a single block has them count its symbols instead.
+    bool single_block = src->data && src->len <= options->block_size;
+
+    usize ready = 0;
+    while (ready < job_count && block_encoder_init(&jobs[ready].enc, options->block_size, src->data == NULL)) {
+        jobs[ready].task.run = compress_job_run;
+        jobs[ready].task.arg = &jobs[ready];
+        jobs[ready].options = options;
+        jobs[ready].enc.hist_threads = single_block ? options->threads : 1;
+        jobs[ready].enc.reuse = job_count == 1 && options->table_reuse > 0;
+        ready++;
+    }
+
+    struct pool* pool = NULL;
+    bool ok = ready == job_count;
+    if (ok && options->threads > 1) {
+        pool = pool_create(options->threads);
+        ok = pool != NULL;
+    }
+
+    u8 flags = options->table ? FILE_FLAG_TABLE : 0;
+    if (ok) {
+        io_write(out, (void*)FILE_MAGIC, countof(FILE_MAGIC));
+        io_write_u8_le(out, FFORMAT_VERSION_BLOCKS);
+        io_write_u8_le(out, flags);
+        io_write_u32_le(out, (u32)options->block_size);
+        io_write_u64_le(out, FFORMAT_UNKNOWN_SIZE);
+        if (options->table)
+            io_write_u32_le(out, options->table->id);
+    }
+
+    struct fformat_index index = { 0 };
+    usize index_capacity = 0;
+    u64 input_size = 0;
+    u64 output_size = blocks_offset(flags);
+    u64 next_read = 0, next_write = 0;
+    bool eof = false;
+
+    while (ok) {
+        while (!eof && next_read - next_write < job_count) {
+            struct compress_job* job = &jobs[next_read % job_count];
+            job->block = source_next(src, job->enc.block, options->block_size);
+            if (job->block.len == 0) {
+                eof = true;
+                break;
+            }
+
+            memset(&job->stats, 0, sizeof(job->stats));
+            pool_submit(pool, &job->task);
+            next_read++;
+        }
+
+        if (next_write == next_read)
+            break;
+
+        struct compress_job* job = &jobs[next_write % job_count];
+        pool_wait(pool, &job->task);
+
+        STATS_BEGIN(write_timer);
+        ok = job->size > 0 && write_full(out, job->enc.out.data, job->size);
+        STATS_END(STATS_WRITE, write_timer);
+        if (ok) {
+            struct fformat_block entry = {
+                .offset = output_size,
+                .raw_offset = input_size,
+                .raw_len = (u32)job->block.len,
+                .size = (u32)job->size,
+            };
+            ok = index_push(&index, &index_capacity, entry);
+        }
+
+        input_size += job->block.len;
+        output_size += job->size;
+        next_write++;
+
+        if (stats) {
+            stats->content_bits += job->stats.content_bits;
+            stats->unlimited_bits += job->stats.unlimited_bits;
+            stats->exact_bits += job->stats.exact_bits;
+            stats->stored_blocks += job->stats.stored_blocks;
+            stats->reused_blocks += job->stats.reused_blocks;
+            stats->context_blocks += job->stats.context_blocks;
+            stats->bwt_blocks += job->stats.bwt_blocks;
+        }
+    }
+
+    // Lets the blocks still in flight finish before their buffers go away
+    pool_destroy(pool);
+    for (usize i = 0; i < ready; i++)
+        block_encoder_free(&jobs[i].enc);
+    free(jobs);
+
+    ok = ok && write_end_block(out, &index);
+    output_size += BLOCK_HEADER_SIZE + index.len * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE;
+    buffer_free(&index);
+
+    if (!ok)
+        return false;
+
+    // The size is only known now, streams that can't seek keep the unknown size
+    if (io_seek(out, ORIGINAL_SIZE_OFFSET, SEEK_SET) == 0) {
+        io_write_u64_le(out, input_size);
+        io_seek(out, 0, SEEK_END);
+    }
+
+    if (stats) {
+        stats->input_size = input_size;
+        stats->output_size = output_size;
+        stats->blocks = next_write;
+    }
+
+    return true;
+}
+
+bool fformat_compress(struct io_stream* out, struct io_stream* in, const struct fformat_options* options, struct fformat_stats* stats) {
+    struct block_source src = { .io = in };
+    return compress_blocks(out, &src, options, stats);
+}
+
+bool fformat_compress_memory(struct io_stream* out, const struct buffer_u8* input, const struct fformat_options* options, struct fformat_stats* stats) {
+    struct block_source src = { .data = input->data, .len = input->len };
+
+    // An empty buffer may have no data at all, it still makes an empty archive
+    static const u8 empty = 0;
+    if (!src.data)
+        src.data = &empty;
+
+    return compress_blocks(out, &src, options, stats);
+}
+
+// Scratch memory for decompressing blocks
+struct block_decoder {
+    struct hdecoder decoder;
+    struct hcode codes[ALPHABET_SIZE];
+    struct buffer_u8 rle; // run-length coded symbols, grown when needed
+    struct buffer_u8 bwt; // Burrows-Wheeler scratch memory, grown when needed
+    const struct fformat_table* table; // for static blocks
+    struct table_cache cache;          // for repeat blocks
+    u64 loaded; // number + 1 of the block whose table `decoder` holds, 0 if none
+    struct hdecoder* contexts; // FFORMAT_MAX_CONTEXT_TABLES, allocated for the first context block
+};
+
+// Frees the scratch buffers of a zero-initialized decoder, not the decoder
+static void block_decoder_free(struct block_decoder* dec) {
+    if (dec) {
+        buffer_free(&dec->rle);
+        buffer_free(&dec->bwt);
+        free(dec->contexts);
+        dec->contexts = NULL;
+    }
+}
+
+// Makes a reader for each of `streams` bitstreams, preceded by the size of all
+// of them but the last
+static bool open_streams(const u8* data, usize len, usize streams, struct bitreader* br) {
+    usize offset = (streams - 1) * sizeof(u32);
+    if (offset > len) {
+        fprintf(stderr, "error: unexpected end of stream sizes\n");
+        return false;
+    }
+
+    for (usize k = 0; k < streams; k++) {
+        usize stream_len = len - offset;
+        if (k < streams - 1)
+            stream_len = load_u32_le(data + k * sizeof(u32));
+
+        if (stream_len > len - offset) {
+            fprintf(stderr, "error: stream is larger than its block, is the file ill formatted?\n");
+            return false;
+        }
+
+        br[k] = bitreader_make(data + offset, stream_len);
+        offset += stream_len;
+    }
+
+    return true;
+}
+
+static bool decode_bitstreams(const struct hdecoder* decoder, const u8* data, usize len, usize streams, u8* out, usize out_len) {
+    if (streams == 1) {
+        struct bitreader br = bitreader_make(data, len);
+        return decode_symbols(decoder, &br, out, out_len);
+    }
+
+    struct bitreader br[FFORMAT_MAX_STREAMS];
+    if (!open_streams(data, len, streams, br))
+        return false;
+
+    // Constant stream counts let the compiler unroll the rounds
+    if (streams == 4)
+        return decode_interleaved(decoder, br, 4, out, out_len);
+    if (streams == 8)
+        return decode_interleaved(decoder, br, 8, out, out_len);
+    return decode_interleaved(decoder, br, streams, out, out_len);
+}
+
+// Decodes `out_len` symbols from `streams` bitstreams, preceded by the size of
+// all of them but the last
+static bool decode_streams(const struct hdecoder* decoder, const u8* data, usize len, usize streams, u8* out, usize out_len) {
+    STATS_BEGIN(timer);
+    bool ok = decode_bitstreams(decoder, data, len, streams, out, out_len);
+    STATS_END(STATS_DECODE, timer);
+    return ok;
+}
+
+// Decodes `out_len` symbols from a payload holding a code lengths table and
+// `streams` bitstreams. The table is cached for the repeat blocks that follow.
+static bool decode_huffman(struct block_decoder* dec, u64 block_no, const u8* payload, usize payload_len, usize streams, u8* out, usize out_len) {
+    struct buffer_hcode code_map = { .data = dec->codes, .len = ALPHABET_SIZE };
+    memset(dec->codes, 0, sizeof(dec->codes));
+
+    STATS_BEGIN(timer);
+    dec->loaded = 0;
+    usize table_size = code_lengths_unpack(payload, payload_len, &code_map);
+    if (!table_size || !hcode_canonical(&code_map)
+        || !hdecoder_build(&dec->decoder, code_map, streams == 1 ? out_len : 0))
+        return false;
+    STATS_END(STATS_TABLE, timer);
+
+    dec->loaded = block_no + 1;
+    table_cache_push(&dec->cache, block_no, dec->codes);
+    return decode_streams(&dec->decoder, payload + table_size, payload_len - table_size, streams, out, out_len);
+}
+
+// Where the table of a repeat block comes from, found from the block's bytes
+static bool repeat_source(const u8* block, usize size, u64 block_no, u64* source) {
+    usize offset = BLOCK_HEADER_SIZE + block_prefix(block[1]);
+    if (offset + sizeof(u32) > size) {
+        fprintf(stderr, "error: unexpected end of block\n");
+        return false;
+    }
+
+    u32 distance = load_u32_le(block + offset);
+    if (distance == 0 || distance > block_no) {
+        fprintf(stderr, "error: block %llu reuses the table of a block that doesn't come before it\n", (unsigned long long)block_no);
+        return false;
+    }
+
+    *source = block_no - distance;
+    return true;
+}
+
+// Caches the table of Huffman block `block_no`, from the start of the block
+// (header included), so repeat blocks can be decoded without the blocks before them
+static bool block_decoder_load(struct block_decoder* dec, u64 block_no, const u8* block, usize size) {
+    if (table_cache_find(&dec->cache, block_no))
+        return true;
+
+    if (size < BLOCK_HEADER_SIZE || block[0] != BLOCK_HUFFMAN) {
+        fprintf(stderr, "error: repeat block refers to block %llu, which has no code table\n", (unsigned long long)block_no);
+        return false;
+    }
+
+    usize end = BLOCK_HEADER_SIZE + (usize)load_u32_le(block + 6);
+    usize offset = BLOCK_HEADER_SIZE + block_prefix(block[1]);
+    if (end > size)
+        end = size;
+    if (offset > end) {
+        fprintf(stderr, "error: unexpected end of block\n");
+        return false;
+    }
+
+    struct hcode codes[ALPHABET_SIZE] = { 0 };
+    struct buffer_hcode code_map = { .data = codes, .len = ALPHABET_SIZE };
+    if (!code_lengths_unpack(block + offset, end - offset, &code_map) || !hcode_canonical(&code_map))
+        return false;
+
+    table_cache_push(&dec->cache, block_no, codes);
+    return true;
+}
+
+// Decodes a repeat block with a cached table. Runs of blocks reusing the same
+// table only build its decode tables once.
+static bool decode_repeat(struct block_decoder* dec, u64 block_no, const u8* payload, usize payload_len, usize streams, u8* out, usize out_len) {
+    if (payload_len < sizeof(u32)) {
+        fprintf(stderr, "error: unexpected end of block\n");
+        return false;
+    }
+
+    u32 distance = load_u32_le(payload);
+    if (distance == 0 || distance > block_no) {
+        fprintf(stderr, "error: block %llu reuses the table of a block that doesn't come before it\n", (unsigned long long)block_no);
+        return false;
+    }
+
+    u64 source = block_no - distance;
+    if (dec->loaded != source + 1) {
+        const struct hcode* codes = table_cache_find(&dec->cache, source);
+        if (!codes) {
+            fprintf(stderr, "error: block %llu reuses the table of block %llu, which is no longer cached\n",
+                (unsigned long long)block_no, (unsigned long long)source);
+            return false;
+        }
+
+        STATS_BEGIN(timer);
+        memcpy(dec->codes, codes, sizeof(dec->codes));
+        struct buffer_hcode code_map = { .data = dec->codes, .len = ALPHABET_SIZE };
+        dec->loaded = 0;
+        if (!hdecoder_build(&dec->decoder, code_map, streams == 1 ? out_len : 0))
+            return false;
+        dec->loaded = source + 1;
+        STATS_END(STATS_TABLE, timer);
+    }
+
+    return decode_streams(&dec->decoder, payload + sizeof(u32), payload_len - sizeof(u32), streams, out, out_len);
+}
+
+// Decodes `len` symbols split in `n` parts, each from its own bitstream and
+// with the decoder of the symbol before it. Each symbol waits on the one
+// before it, so the parts are decoded side by side to overlap their lookups.
+static inline bool decode_context_parts(const struct hdecoder* const* by_context, struct bitreader* br, usize n, u8* out, usize len) {
+    u8* part[FFORMAT_MAX_STREAMS];
+    usize part_len[FFORMAT_MAX_STREAMS];
+    u8 prev[FFORMAT_MAX_STREAMS];
+    for (usize k = 0; k < n; k++) {
+        part[k] = out + context_part(len, n, k);
+        part_len[k] = context_part(len, n, k + 1) - context_part(len, n, k);
+        prev[k] = 0;
+    }
+
+    // Parts differ by one symbol at most, all of them have `common` symbols
+    usize common = len / n;
+    usize i = 0;
+    bool ok = true;
+
+    for (; i + 3 <= common; i += 3) {
+        for (usize k = 0; k < n; k++)
+            bitreader_refill(&br[k]);
+
+        for (usize round = 0; round < 3; round++) {
+            for (usize k = 0; k < n; k++) {
+                ok &= decode_symbol(by_context[prev[k]], &br[k], &part[k][i + round]);
+                prev[k] = part[k][i + round];
+            }
+        }
+    }
+
+    for (usize k = 0; k < n; k++) {
+        for (usize j = i; j < part_len[k]; j++) {
+            bitreader_refill(&br[k]);
+            ok &= decode_symbol(by_context[prev[k]], &br[k], &part[k][j]);
+            prev[k] = part[k][j];
+        }
+    }
+
+    if (!ok) {
+        fprintf(stderr, "error: invalid code in compressed data, is the file ill formatted?\n");
+        return false;
+    }
+
+    for (usize k = 0; k < n; k++) {
+        if (bitreader_overrun(&br[k])) {
+            fprintf(stderr, "error: unexpected end of compressed data\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Decodes a context block, building the decode tables of all its tables first
+static bool decode_context(struct block_decoder* dec, const u8* payload, usize payload_len, usize streams, u8* out, usize out_len) {
+    if (payload_len < 1 || payload[0] == 0 || payload[0] > FFORMAT_MAX_CONTEXT_TABLES) {
+        fprintf(stderr, "error: invalid context table count, is the file ill formatted?\n");
+        return false;
+    }
+
+    if (!dec->contexts) {
+        dec->contexts = malloc(FFORMAT_MAX_CONTEXT_TABLES * sizeof(struct hdecoder));
+        if (!dec->contexts) {
+            fprintf(stderr, "error: failed to allocate context decode tables: %s\n", strerror(errno));
+            return false;
+        }
+    }
+
+    usize tables = payload[0];
+    u8 map[ALPHABET_SIZE];
+    usize offset = 1;
+    usize map_size = context_map_unpack(payload + offset, payload_len - offset, tables, map);
+    if (!map_size)
+        return false;
+    offset += map_size;
+
+    STATS_BEGIN(timer);
+    for (usize t = 0; t < tables; t++) {
+        struct hcode codes[ALPHABET_SIZE] = { 0 };
+        struct buffer_hcode code_map = { .data = codes, .len = ALPHABET_SIZE };
+        usize table_size = code_lengths_unpack(payload + offset, payload_len - offset, &code_map);
+        if (!table_size || !hcode_canonical(&code_map) || !hdecoder_build(&dec->contexts[t], code_map, 0))
+            return false;
+        offset += table_size;
+    }
+    STATS_END(STATS_TABLE, timer);
+
+    const struct hdecoder* by_context[ALPHABET_SIZE];
+    for (usize c = 0; c < ALPHABET_SIZE; c++)
+        by_context[c] = &dec->contexts[map[c]];
+
+    struct bitreader br[FFORMAT_MAX_STREAMS];
+    if (!open_streams(payload + offset, payload_len - offset, streams, br))
+        return false;
+
+    // Constant stream counts let the compiler unroll the rounds
+    STATS_BEGIN(decode_timer);
+    bool ok;
+    if (streams == 1)
+        ok = decode_context_parts(by_context, br, 1, out, out_len);
+    else if (streams == 4)
+        ok = decode_context_parts(by_context, br, 4, out, out_len);
+    else if (streams == 8)
+        ok = decode_context_parts(by_context, br, 8, out, out_len);
+    else
+        ok = decode_context_parts(by_context, br, streams, out, out_len);
+    STATS_END(STATS_DECODE, decode_timer);
+    return ok;
+}
+
+// Static blocks have no code table, they are decoded with the archive's one
+static bool decode_coded(struct block_decoder* dec, u8 type, u64 block_no, const u8* payload, usize payload_len, usize streams, u8* out, usize out_len) {
+    if (type == BLOCK_HUFFMAN)
+        return decode_huffman(dec, block_no, payload, payload_len, streams, out, out_len);
+    if (type == BLOCK_REPEAT)
+        return decode_repeat(dec, block_no, payload, payload_len, streams, out, out_len);
+    if (type == BLOCK_CONTEXT)
+        return decode_context(dec, payload, payload_len, streams, out, out_len);
+
+    if (!dec->table) {
+        fprintf(stderr, "error: block is coded with a static table but the archive has none\n");
+        return false;
+    }
+
+    return decode_streams(&dec->table->decoder, payload, payload_len, streams, out, out_len);
+}
+
+// Where decoded data goes: straight into memory when `data` is set, otherwise
+// written to `io`
+struct block_sink {
+    struct io_stream* io;
+    u8* data;
+    u64 len;
+};
+
+static bool sink_check_size(const struct block_sink* sink, u64 original_size) {
+    if (sink->data && original_size == FFORMAT_UNKNOWN_SIZE) {
+        fprintf(stderr, "error: archive was streamed and doesn't know its size, it can't be decoded into memory\n");
+        return false;
+    }
+
+    if (sink->data && original_size != sink->len) {
+        fprintf(stderr, "error: archive holds %llu bytes but the output has room for %llu\n",
+            (unsigned long long)original_size, (unsigned long long)sink->len);
+        return false;
+    }
+
+    return true;
+}
+
+// Versions 0 and 1: a single code table followed by a bitstream that goes until
+// the end of the file
+static bool decompress_single(struct block_sink* sink, struct io_stream* in, u8 version) {
+    // The content goes until the end of the file, which takes seeking to find
+    if (io_tell(in) < 0) {
+        fprintf(stderr, "error: version %u archives can't be read from a stream that can't seek\n", version);
+        return false;
+    }
+
+    u64 original_file_size = io_read_u64_le(in);
+    if (!sink_check_size(sink, original_file_size))
+        return false;
+
+    struct block_decoder* dec = malloc(sizeof(struct block_decoder));
+    if (!dec) {
+        fprintf(stderr, "error: failed to allocate decode table: %s\n", strerror(errno));
+        return false;
+    }
+
+    struct buffer_hcode code_map = { .data = dec->codes, .len = ALPHABET_SIZE };
+    memset(dec->codes, 0, sizeof(dec->codes));
+
+    if (version == FFORMAT_VERSION_LEGACY) {
+        u32 offset_to_content = io_read_u32_le(in);
+
+        // Count how many entries there are
+        usize entries_count = 0;
+        {
+            long current_position = io_tell(in);
+            entries_count = (offset_to_content - current_position) / HCODE_ENTRY_SIZE;
+        }
+
+        for (usize i = 0; i < entries_count; i++) {
+            u8 symbol = io_read_u8_le(in);
+            struct hcode new_code = {
+                .bits = io_read_u16_le(in),
+                .bit_len = io_read_u8_le(in)
+            };
+
+            code_map.data[symbol] = new_code;
+        }
+
+        io_seek(in, offset_to_content, SEEK_SET);
+    }
+
+    usize compressed_size = 0;
+    {
+        long content_start = io_tell(in);
+        io_seek(in, 0, SEEK_END);
+        long end = io_tell(in);
+        io_seek(in, content_start, SEEK_SET);
+        compressed_size = end > content_start ? (usize)(end - content_start) : 0;
+    }
+
+    struct buffer_u8 compressed_data;
+    buffer_alloc(&compressed_data, compressed_size);
+    struct buffer_u8 decompressed = { .data = sink->data, .len = original_file_size };
+    if (!sink->data)
+        buffer_alloc(&decompressed, original_file_size);
+
+    if (!compressed_data.data || !decompressed.data) {
+        fprintf(stderr, "error: failed to allocate decompression buffers: %s\n", strerror(errno));
+        buffer_free(&compressed_data);
+        if (!sink->data)
+            buffer_free(&decompressed);
+        free(dec);
+        return false;
+    }
+
+    compressed_data.len = read_full(in, compressed_data.data, compressed_size);
+
+    // Version 1 keeps its code lengths table right before the bitstream
+    usize table_size = 0;
+    bool ok = true;
+    if (version == FFORMAT_VERSION_CANONICAL) {
+        table_size = code_lengths_unpack(compressed_data.data, compressed_data.len, &code_map);
+        ok = table_size > 0 && hcode_canonical(&code_map);
+    }
+
+    if (ok) {
+        struct bitreader br = bitreader_make(compressed_data.data + table_size, compressed_data.len - table_size);
+        ok = hdecoder_build(&dec->decoder, code_map, decompressed.len) && decode_symbols(&dec->decoder, &br, decompressed.data, decompressed.len);
+    }
+
+    if (ok && !sink->data)
+        ok = write_full(sink->io, decompressed.data, decompressed.len);
+
+    buffer_free(&compressed_data);
+    if (!sink->data)
+        buffer_free(&decompressed);
+    free(dec);
+
+    return ok;
+}
+
+// Decodes the run-length coded symbols of a block into scratch memory, then
+// expands the runs into `out`
+static bool decode_rle_huffman(struct block_decoder* dec, u8 type, u64 block_no, const u8* payload, usize payload_len, usize streams, u8* out, usize out_len) {
+    if (payload_len < sizeof(u32)) {
+        fprintf(stderr, "error: unexpected end of block\n");
+        return false;
+    }
+
+    usize coded_len = load_u32_le(payload);
+    if (coded_len == 0 || coded_len > rle_bound(out_len)) {
+        fprintf(stderr, "error: invalid run-length coded size, is the file ill formatted?\n");
+        return false;
+    }
+
+    if (dec->rle.len < coded_len) {
+        buffer_free(&dec->rle);
+        buffer_alloc(&dec->rle, coded_len);
+        if (!dec->rle.data) {
+            fprintf(stderr, "error: failed to allocate run-length buffer: %s\n", strerror(errno));
+            return false;
+        }
+    }
+
+    return decode_coded(dec, type, block_no, payload + sizeof(u32), payload_len - sizeof(u32), streams, dec->rle.data, coded_len)
+        && rle_decode(dec->rle.data, coded_len, out, out_len);
+}
+
+// Decodes the Burrows-Wheeler coded symbols of a block into scratch memory,
+// then undoes the transform into `out`
+static bool decode_bwt_huffman(struct block_decoder* dec, u8 type, u64 block_no, const u8* payload, usize payload_len, usize streams, u8* out, usize out_len) {
+    usize prefix = block_prefix(BLOCK_FLAG_BWT);
+    if (payload_len < prefix) {
+        fprintf(stderr, "error: unexpected end of block\n");
+        return false;
+    }
+
+    usize coded_len = load_u32_le(payload);
+    u32 origin = load_u32_le(payload + sizeof(u32));
+    if (coded_len == 0 || coded_len > bwt_bound(out_len)) {
+        fprintf(stderr, "error: invalid Burrows-Wheeler coded size, is the file ill formatted?\n");
+        return false;
+    }
+
+    usize scratch = bwt_decode_scratch(out_len);
+    if (dec->bwt.len < scratch) {
+        buffer_free(&dec->bwt);
+        buffer_alloc(&dec->bwt, scratch);
+        if (!dec->bwt.data) {
+            fprintf(stderr, "error: failed to allocate Burrows-Wheeler buffer: %s\n", strerror(errno));
+            return false;
+        }
+    }
+
+    // The coded symbols fit in the part of the scratch memory the inverse
+    // transform only uses once they were read
+    if (!decode_coded(dec, type, block_no, payload + prefix, payload_len - prefix, streams, dec->bwt.data, coded_len))
+        return false;
+
+    STATS_BEGIN(timer);
+    bool ok = bwt_decode(dec->bwt.data, coded_len, origin, out, out_len, dec->bwt.data);
+    STATS_END(STATS_TRANSFORM, timer);
+    return ok;
+}
+
+// Blocks are numbered from 0 in the order they are stored, which repeat blocks
+// refer to
+static bool decode_block(struct block_decoder* dec, u8 type, u8 flags, u64 block_no, const u8* payload, usize payload_len, u8* out, usize raw_len) {
+    usize streams = (flags & BLOCK_FLAG_STREAMS) + 1;
+    u8 known = BLOCK_FLAG_STREAMS | BLOCK_FLAG_RLE | BLOCK_FLAG_BWT;
+    if ((flags & ~known) != 0 || ((flags & BLOCK_FLAG_RLE) && (flags & BLOCK_FLAG_BWT)) || streams > FFORMAT_MAX_STREAMS) {
+        fprintf(stderr, "error: unknown block flags 0x%02x\n", flags);
+        return false;
+    }
+
+    switch (type) {
+    case BLOCK_HUFFMAN:
+    case BLOCK_STATIC:
+    case BLOCK_REPEAT:
+    case BLOCK_CONTEXT:
+        if (flags & BLOCK_FLAG_BWT)
+            return decode_bwt_huffman(dec, type, block_no, payload, payload_len, streams, out, raw_len);
+        if (flags & BLOCK_FLAG_RLE)
+            return decode_rle_huffman(dec, type, block_no, payload, payload_len, streams, out, raw_len);
+        return decode_coded(dec, type, block_no, payload, payload_len, streams, out, raw_len);
+    case BLOCK_SINGLE:
+        if (payload_len != 1) {
+            fprintf(stderr, "error: single symbol block has %zu bytes but should have 1\n", payload_len);
+            return false;
+        }
+
+        memset(out, payload[0], raw_len);
+        return true;
+    case BLOCK_STORED:
+        if (payload_len != raw_len) {
+            fprintf(stderr, "error: stored block has %zu bytes but should have %zu\n", payload_len, raw_len);
+            return false;
+        }
+
+        memcpy(out, payload, raw_len);
+        return true;
+    default:
+        fprintf(stderr, "error: unknown block type %u\n", type);
+        return false;
+    }
+}
+
+// Fields of a version 2 file header that follow the version byte
+static bool read_blocks_header(struct io_stream* in, struct fformat_index* header) {
+    u8 fields[FILE_HEADER_SIZE - countof(FILE_MAGIC) - sizeof(u8)];
+    if (read_full(in, fields, sizeof(fields)) != sizeof(fields)) {
+        fprintf(stderr, "error: unexpected end of archive\n");
+        return false;
+    }
+
+    header->flags = fields[0];
+    header->block_size = load_u32_le(fields + 1);
+    header->original_size = load_u64_le(fields + 5);
+
+    if (header->flags & ~FILE_FLAG_TABLE) {
+        fprintf(stderr, "error: unknown archive flags 0x%02x\n", header->flags);
+        return false;
+    }
+
+    if (header->block_size < FFORMAT_MIN_BLOCK_SIZE || header->block_size > FFORMAT_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "error: invalid block size %u\n", header->block_size);
+        return false;
+    }
+
+    if (header->flags & FILE_FLAG_TABLE) {
+        u8 id[sizeof(u32)];
+        if (read_full(in, id, sizeof(id)) != sizeof(id)) {
+            fprintf(stderr, "error: unexpected end of archive\n");
+            return false;
+        }
+
+        header->table_id = load_u32_le(id);
+    }
+
+    return true;
+}
+
+// Finds the static table the blocks of an archive are coded with: NULL when
+// the archive doesn't use one, fails when it does but `table` isn't that one
+static bool archive_table(const struct fformat_index* header, const struct fformat_table** table) {
+    if (!(header->flags & FILE_FLAG_TABLE)) {
+        *table = NULL;
+        return true;
+    }
+
+    if (!*table) {
+        fprintf(stderr, "error: archive was compressed with static table %08x, which wasn't given\n", header->table_id);
+        return false;
+    }
+
+    if ((*table)->id != header->table_id) {
+        fprintf(stderr, "error: archive was compressed with static table %08x, not %08x\n", header->table_id, (*table)->id);
+        return false;
+    }
+
+    return true;
+}
+
+// Reads the block index from the end block at the end of `in`. Archives written
+// before the index existed and truncated archives have none, so failures are
+// quiet and callers fall back to reading the blocks in order.
+static bool load_index(struct io_stream* in, struct fformat_index* index) {
+    u8 trailer[INDEX_TRAILER_SIZE];
+    if (io_seek(in, -(long)INDEX_TRAILER_SIZE, SEEK_END) != 0)
+        return false;
+
+    long trailer_offset = io_tell(in);
+    if (read_full(in, trailer, sizeof(trailer)) != sizeof(trailer))
+        return false;
+
+    if (memcmp(trailer + sizeof(u64), INDEX_MAGIC, countof(INDEX_MAGIC)) != 0)
+        return false;
+
+    u64 count = load_u64_le(trailer);
+    u64 payload_len = count * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE;
+    if (count > (u64)trailer_offset / INDEX_ENTRY_SIZE)
+        return false;
+
+    long end_offset = trailer_offset - (long)(count * INDEX_ENTRY_SIZE) - (long)BLOCK_HEADER_SIZE;
+    if (end_offset < (long)blocks_offset(index->flags) || io_seek(in, end_offset, SEEK_SET) != 0)
+        return false;
+
+    struct buffer_u8 end;
+    buffer_alloc(&end, BLOCK_HEADER_SIZE + count * INDEX_ENTRY_SIZE);
+    if (!end.data)
+        return false;
+
+    bool ok = read_full(in, end.data, end.len) == end.len && end.data[0] == BLOCK_END
+        && load_u32_le(end.data + 6) == payload_len;
+
+    if (ok) {
+        buffer_alloc(index, count);
+        ok = index->data != NULL;
+    }
+
+    // Blocks must follow each other without gaps, both in the archive and in
+    // the original file
+    u64 offset = blocks_offset(index->flags), raw_offset = 0;
+    for (usize i = 0; ok && i < count; i++) {
+        const u8* p = end.data + BLOCK_HEADER_SIZE + i * INDEX_ENTRY_SIZE;
+        struct fformat_block entry = {
+            .offset = load_u64_le(p),
+            .raw_offset = load_u64_le(p + 8),
+            .raw_len = load_u32_le(p + 16),
+            .size = load_u32_le(p + 20),
+        };
+
+        ok = entry.offset == offset && entry.raw_offset == raw_offset && entry.raw_len <= index->block_size
+            && entry.size >= BLOCK_HEADER_SIZE && entry.size <= fformat_block_bound(index->block_size);
+
+        index->data[i] = entry;
+        offset += entry.size;
+        raw_offset += entry.raw_len;
+    }
+
+    // Streamed archives don't have the size in their header, the index has it
+    if (index->original_size == FFORMAT_UNKNOWN_SIZE)
+        index->original_size = raw_offset;
+
+    ok = ok && offset == (u64)end_offset && raw_offset == index->original_size;
+    if (!ok)
+        buffer_free(index);
+
+    buffer_free(&end);
+    return ok;
+}
+
+bool fformat_read_index(struct io_stream* in, struct fformat_index* index) {
+    *index = (struct fformat_index) { 0 };
+
+    u8 magic[countof(FILE_MAGIC) + 1];
+    if (io_seek(in, 0, SEEK_SET) != 0 || read_full(in, magic, sizeof(magic)) != sizeof(magic)
+        || memcmp(magic, FILE_MAGIC, countof(FILE_MAGIC)) != 0) {
+        fprintf(stderr, "error: file magic does not match\n");
+        return false;
+    }
+
+    if (magic[countof(FILE_MAGIC)] != FFORMAT_VERSION_BLOCKS) {
+        fprintf(stderr, "error: only version %d archives have a block index\n", FFORMAT_VERSION_BLOCKS);
+        return false;
+    }
+
+    if (!read_blocks_header(in, index))
+        return false;
+
+    if (!load_index(in, index)) {
+        fprintf(stderr, "error: archive has no valid block index\n");
+        return false;
+    }
+
+    return true;
+}
+
+static bool decompress_blocks(struct block_sink* sink, struct io_stream* in, struct fformat_index* header, const struct fformat_table* table) {
+    struct block_decoder* dec = calloc(1, sizeof(struct block_decoder));
+    struct buffer_u8 payload, raw = { 0 };
+    buffer_alloc(&payload, fformat_block_bound(header->block_size));
+    if (!sink->data)
+        buffer_alloc(&raw, header->block_size);
+
+    if (!dec || !payload.data || (!sink->data && !raw.data)) {
+        fprintf(stderr, "error: failed to allocate decompression buffers: %s\n", strerror(errno));
+        free(dec);
+        buffer_free(&payload);
+        buffer_free(&raw);
+        return false;
+    }
+
+    dec->table = table;
+    u64 total = 0, blocks = 0;
+    bool ok = true;
+
+    while (ok) {
+        u8 block_header[BLOCK_HEADER_SIZE];
+        if (read_full(in, block_header, sizeof(block_header)) != sizeof(block_header)) {
+            fprintf(stderr, "error: unexpected end of archive\n");
+            ok = false;
+            break;
+        }
+
+        u8 type = block_header[0];
+        u32 raw_len = load_u32_le(block_header + 2);
+        u32 payload_len = load_u32_le(block_header + 6);
+
+        if (type == BLOCK_END)
+            break;
+
+        if (raw_len > header->block_size || payload_len > payload.len) {
+            fprintf(stderr, "error: block is larger than the block size, is the file ill formatted?\n");
+            ok = false;
+            break;
+        }
+
+        STATS_BEGIN(read_timer);
+        if (read_full(in, payload.data, payload_len) != payload_len) {
+            fprintf(stderr, "error: unexpected end of archive\n");
+            ok = false;
+            break;
+        }
+        STATS_END(STATS_READ, read_timer);
+
+        if (sink->data) {
+            if (raw_len > sink->len - total) {
+                fprintf(stderr, "error: archive holds more bytes than its header says\n");
+                ok = false;
+                break;
+            }
+
+            ok = decode_block(dec, type, block_header[1], blocks, payload.data, payload_len, sink->data + total, raw_len);
+        } else {
+            ok = decode_block(dec, type, block_header[1], blocks, payload.data, payload_len, raw.data, raw_len);
+
+            STATS_BEGIN(write_timer);
+            ok = ok && write_full(sink->io, raw.data, raw_len);
+            STATS_END(STATS_WRITE, write_timer);
+        }
+
+        total += raw_len;
+        blocks++;
+    }
+
+    if (ok && header->original_size != FFORMAT_UNKNOWN_SIZE && total != header->original_size) {
+        fprintf(stderr, "error: archive holds %llu bytes but its header says %llu\n",
+            (unsigned long long)total, (unsigned long long)header->original_size);
+        ok = false;
+    }
+
+    block_decoder_free(dec);
+    free(dec);
+    buffer_free(&payload);
+    buffer_free(&raw);
+
+    return ok;
+}
+
+// The start of a block, up to the end of its code table
+#define BLOCK_TABLE_MAX (BLOCK_HEADER_SIZE + 3 * sizeof(u32) + ALPHABET_SIZE)
+
+// Reads the code table of a block that is decoded out of order, see block_decoder_load
+static bool read_block_table(struct io_stream* in, const struct fformat_block* entry, u8* buffer, usize* size) {
+    *size = entry->size < BLOCK_TABLE_MAX ? entry->size : BLOCK_TABLE_MAX;
+    if (io_seek(in, (long)entry->offset, SEEK_SET) != 0 || read_full(in, buffer, *size) != *size) {
+        fprintf(stderr, "error: unexpected end of archive\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Decodes one block of a window straight into its place in the window's output
+struct decompress_job {
+    struct pool_task task;
+    struct block_decoder dec;
+    const u8* block;
+    struct fformat_block entry;
+    u64 block_no;
+    u8* out;
+    bool ok;
+
+    // The block whose table a repeat block uses
+    const u8* source;
+    usize source_len;
+    u64 source_no;
+    u8 source_table[BLOCK_TABLE_MAX]; // when the block is outside the window
+};
+
+static void decompress_job_run(void* arg) {
+    struct decompress_job* job = arg;
+    const u8* block = job->block;
+    u32 raw_len = load_u32_le(block + 2);
+    u32 payload_len = load_u32_le(block + 6);
+
+    if (raw_len != job->entry.raw_len || BLOCK_HEADER_SIZE + (usize)payload_len != job->entry.size) {
+        fprintf(stderr, "error: block does not match the block index, is the file ill formatted?\n");
+        job->ok = false;
+        return;
+    }
+
+    if (job->source && !block_decoder_load(&job->dec, job->source_no, job->source, job->source_len)) {
+        job->ok = false;
+        return;
+    }
+
+    job->ok = decode_block(&job->dec, block[0], block[1], job->block_no, block + BLOCK_HEADER_SIZE, payload_len, job->out, raw_len);
+}
+
+// Uses the block index to decode a window of consecutive blocks at a time: the
+// window is read with a single read, all its blocks are decoded concurrently
+// into their final positions in the output window, and the window is written.
+// Memory sinks skip the output window, blocks land in the sink directly.
+static bool decompress_parallel(struct block_sink* sink, struct io_stream* in, struct fformat_index* index, usize threads,
+    const struct fformat_table* table) {
+    usize window = 2 * threads;
+    struct decompress_job* jobs = calloc(window, sizeof(struct decompress_job));
+    struct buffer_u8 compressed, raw = { 0 };
+    buffer_alloc(&compressed, window * fformat_block_bound(index->block_size));
+    if (!sink->data)
+        buffer_alloc(&raw, window * index->block_size);
+    struct pool* pool = pool_create(threads);
+
+    bool ok = jobs && compressed.data && (sink->data || raw.data) && pool;
+    if (!ok)
+        fprintf(stderr, "error: failed to allocate decompression buffers: %s\n", strerror(errno));
+
+    for (usize first = 0; ok && first < index->len; first += window) {
+        usize count = index->len - first < window ? index->len - first : window;
+        struct fformat_block* head = &index->data[first];
+        struct fformat_block* tail = &index->data[first + count - 1];
+        usize compressed_len = (usize)(tail->offset + tail->size - head->offset);
+        usize raw_len = (usize)(tail->raw_offset + tail->raw_len - head->raw_offset);
+
+        STATS_BEGIN(read_timer);
+        if (io_seek(in, (long)head->offset, SEEK_SET) != 0 || read_full(in, compressed.data, compressed_len) != compressed_len) {
+            fprintf(stderr, "error: unexpected end of archive\n");
+            ok = false;
+            break;
+        }
+        STATS_END(STATS_READ, read_timer);
+
+        for (usize i = 0; i < count; i++) {
+            struct decompress_job* job = &jobs[i];
+            job->task.run = decompress_job_run;
+            job->task.arg = job;
+            job->dec.table = table;
+            job->entry = head[i];
+            job->block_no = first + i;
+            job->block = compressed.data + (head[i].offset - head->offset);
+            job->out = sink->data ? sink->data + head[i].raw_offset : raw.data + (head[i].raw_offset - head->raw_offset);
+
+            // Repeat blocks get the table they use from the window, or from
+            // the archive when it is in an earlier window
+            job->source = NULL;
+            if (job->block[0] == BLOCK_REPEAT && (ok = repeat_source(job->block, head[i].size, job->block_no, &job->source_no))) {
+                struct fformat_block* source = &index->data[job->source_no];
+                if (job->source_no >= first) {
+                    job->source = compressed.data + (source->offset - head->offset);
+                    job->source_len = source->size;
+                } else {
+                    ok = read_block_table(in, source, job->source_table, &job->source_len);
+                    job->source = job->source_table;
+                }
+            }
+
+            if (!ok) {
+                count = i;
+                break;
+            }
+
+            pool_submit(pool, &job->task);
+        }
+
+        for (usize i = 0; i < count; i++) {
+            pool_wait(pool, &jobs[i].task);
+            ok = ok && jobs[i].ok;
+        }
+
+        if (!sink->data) {
+            STATS_BEGIN(write_timer);
+            ok = ok && write_full(sink->io, raw.data, raw_len);
+            STATS_END(STATS_WRITE, write_timer);
+        }
+    }
+
+    pool_destroy(pool);
+    for (usize i = 0; jobs && i < window; i++)
+        block_decoder_free(&jobs[i].dec);
+    free(jobs);
+    buffer_free(&compressed);
+    buffer_free(&raw);
+
+    return ok;
+}
+
+bool fformat_read_range(struct io_stream* in, const struct fformat_index* index, const struct fformat_table* table,
+    u64 offset, usize len, struct buffer_u8* out) {
+    *out = (struct buffer_u8) { 0 };
+    if (!archive_table(index, &table))
+        return false;
+
+    if (offset > index->original_size) {
+        fprintf(stderr, "error: offset %llu is past the end of the original file\n", (unsigned long long)offset);
+        return false;
+    }
+
+    if (len > index->original_size - offset)
+        len = (usize)(index->original_size - offset);
+
+    u64 end = offset + len;
+
+    // Find the block holding `offset`
+    usize lo = 0, hi = index->len;
+    while (lo < hi) {
+        usize mid = lo + (hi - lo) / 2;
+        if (index->data[mid].raw_offset + index->data[mid].raw_len <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    struct block_decoder* dec = calloc(1, sizeof(struct block_decoder));
+    struct buffer_u8 block, raw;
+    buffer_alloc(&block, fformat_block_bound(index->block_size));
+    buffer_alloc(&raw, index->block_size);
+    buffer_alloc(out, len);
+
+    bool ok = dec && block.data && raw.data && (out->data || len == 0);
+    if (!ok)
+        fprintf(stderr, "error: failed to allocate decompression buffers: %s\n", strerror(errno));
+    else
+        dec->table = table;
+
+    for (usize i = lo; ok && i < index->len && index->data[i].raw_offset < end; i++) {
+        struct fformat_block entry = index->data[i];
+        if (io_seek(in, (long)entry.offset, SEEK_SET) != 0 || read_full(in, block.data, entry.size) != entry.size) {
+            fprintf(stderr, "error: unexpected end of archive\n");
+            ok = false;
+            break;
+        }
+
+        u32 payload_len = load_u32_le(block.data + 6);
+        if (load_u32_le(block.data + 2) != entry.raw_len || BLOCK_HEADER_SIZE + (usize)payload_len != entry.size) {
+            fprintf(stderr, "error: block does not match the block index, is the file ill formatted?\n");
+            ok = false;
+            break;
+        }
+
+        // The table of a repeat block may come from a block before the range
+        u64 source;
+        if (block.data[0] == BLOCK_REPEAT && (ok = repeat_source(block.data, entry.size, i, &source))
+            && !table_cache_find(&dec->cache, source)) {
+            u8 table[BLOCK_TABLE_MAX];
+            usize table_len;
+            ok = read_block_table(in, &index->data[source], table, &table_len)
+                && block_decoder_load(dec, source, table, table_len);
+        }
+
+        ok = ok && decode_block(dec, block.data[0], block.data[1], i, block.data + BLOCK_HEADER_SIZE, payload_len, raw.data, entry.raw_len);
+
+        // Copy the part of the block that overlaps the range
+        u64 from = offset > entry.raw_offset ? offset : entry.raw_offset;
+        u64 to = end < entry.raw_offset + entry.raw_len ? end : entry.raw_offset + entry.raw_len;
+        if (ok)
+            memcpy(out->data + (from - offset), raw.data + (from - entry.raw_offset), (usize)(to - from));
+    }
+
+    block_decoder_free(dec);
+    free(dec);
+    buffer_free(&block);
+    buffer_free(&raw);
+    if (!ok)
+        buffer_free(out);
+
+    return ok;
+}
+
+static bool decompress(struct block_sink* sink, struct io_stream* in, usize threads, const struct fformat_table* table) {
+    // Read and compare file signature
+    u8 magic[countof(FILE_MAGIC)];
+    if (read_full(in, magic, countof(FILE_MAGIC)) != countof(FILE_MAGIC) || memcmp(magic, FILE_MAGIC, countof(FILE_MAGIC)) != 0) {
+        fprintf(stderr, "error: file magic does not match\n");
+        return false;
+    }
+
+    u8 version = io_read_u8_le(in);
+    switch (version) {
+    case FFORMAT_VERSION_LEGACY:
+    case FFORMAT_VERSION_CANONICAL:
+        return decompress_single(sink, in, version);
+    case FFORMAT_VERSION_BLOCKS:
+        break;
+    default:
+        fprintf(stderr, "error: unsupported archive version %u\n", version);
+        return false;
+    }
+
+    struct fformat_index index = { 0 };
+    if (!read_blocks_header(in, &index) || !sink_check_size(sink, index.original_size) || !archive_table(&index, &table))
+        return false;
+
+    // The index is at the end, streams that can't seek are decoded in order
+    long data_start = io_tell(in);
+    if (threads > 1 && data_start >= 0) {
+        if (load_index(in, &index)) {
+            bool ok = decompress_parallel(sink, in, &index, threads, table);
+            buffer_free(&index);
+            return ok;
+        }
+
+        // No index, decode in order instead
+        if (io_seek(in, data_start, SEEK_SET) != 0) {
+            fprintf(stderr, "error: failed to seek archive\n");
+            return false;
+        }
+    }
+
+    return decompress_blocks(sink, in, &index, table);
+}
+
+bool fformat_decompress(struct io_stream* out, struct io_stream* in, usize threads, const struct fformat_table* table) {
+    struct block_sink sink = { .io = out };
+    return decompress(&sink, in, threads, table);
+}
+
+bool fformat_decompress_into(struct buffer_u8* output, struct io_stream* in, usize threads, const struct fformat_table* table) {
+    // An empty output may have no data at all, point it somewhere so it is
+    // still decoded as memory
+    static u8 empty;
+    struct block_sink sink = { .data = output->data ? output->data : &empty, .len = output->len };
+    return decompress(&sink, in, threads, table);
+}
+
+bool fformat_original_size(struct io_stream* in, u64* size) {
+    u8 header[FILE_HEADER_SIZE];
+    usize header_len = read_full(in, header, sizeof(header));
+    if (io_seek(in, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "error: archive is not seekable\n");
+        return false;
+    }
+
+    if (header_len < countof(FILE_MAGIC) + 1 || memcmp(header, FILE_MAGIC, countof(FILE_MAGIC)) != 0) {
+        fprintf(stderr, "error: file magic does not match\n");
+        return false;
+    }
+
+    // Versions 0 and 1 keep the size right after the version byte
+    u8 version = header[countof(FILE_MAGIC)];
+    usize offset = version == FFORMAT_VERSION_BLOCKS ? ORIGINAL_SIZE_OFFSET : countof(FILE_MAGIC) + 1;
+    if (version > FFORMAT_VERSION_BLOCKS) {
+        fprintf(stderr, "error: unsupported archive version %u\n", version);
+        return false;
+    }
+
+    if (header_len < offset + sizeof(u64)) {
+        fprintf(stderr, "error: unexpected end of archive\n");
+        return false;
+    }
+
+    *size = load_u64_le(header + offset);
+    return true;
+}
+
+bool fformat_compress_buffer(struct buffer_u8* output, struct buffer_u8* input, const struct fformat_options* options) {
+    struct io_stream out = io_memopen(output, "wb");
+    bool ok = out.valid && fformat_compress_memory(&out, input, options, NULL);
+
+    io_close(&out);
+    return ok;
+}
+
+bool fformat_decompress_buffer(struct buffer_u8* output, struct buffer_u8* input, usize threads, const struct fformat_table* table) {
+    *output = (struct buffer_u8) { 0 };
+    struct io_stream in = io_memopen(input, "rb");
+    if (!in.valid)
+        return false;
+
+    // The header has the exact output size, so the output is allocated once
+    // and decoded in place
+    u64 size;
+    bool ok = fformat_original_size(&in, &size);
+
+    // Streamed archives don't know their size, they are decoded into a buffer
+    // that grows instead
+    if (ok && size == FFORMAT_UNKNOWN_SIZE) {
+        struct io_stream out = io_memopen(output, "wb");
+        ok = out.valid && fformat_decompress(&out, &in, threads, table);
+        io_close(&out);
+        io_close(&in);
+        return ok;
+    }
+
+    if (ok && size > SIZE_MAX) {
+        fprintf(stderr, "error: archive is too large to decompress in memory\n");
+        ok = false;
+    }
+
+    if (ok && size > 0) {
+        buffer_alloc(output, (usize)size);
+        if (!output->data) {
+            fprintf(stderr, "error: failed to allocate output buffer: %s\n", strerror(errno));
+            ok = false;
+        }
+    }
+
+    ok = ok && fformat_decompress_into(output, &in, threads, table);
+    io_close(&in);
+    return ok;
+}
+
+// Hashes the code lengths into the table ID (FNV-1a) and builds the decoder,
+// with the multi-symbol table since it serves every archive using the table
+static bool table_build(struct fformat_table* table) {
+    u32 id = 2166136261u;
+    for (usize i = 0; i < ALPHABET_SIZE; i++)
+        id = (id ^ table->codes[i].bit_len) * 16777619u;
+
+    table->id = id;
+    struct buffer_hcode code_map = { .data = table->codes, .len = ALPHABET_SIZE };
+    return hdecoder_build(&table->decoder, code_map, SIZE_MAX);
+}
+
+bool fformat_table_train(struct fformat_table* table, const usize* freqs, u8 max_code_len) {
+    if (max_code_len < 8 || max_code_len > FFORMAT_MAX_CODE_LEN) {
+        fprintf(stderr, "error: code length limit must be between 8 and %d bits\n", FFORMAT_MAX_CODE_LEN);
+        return false;
+    }
+
+    // Symbols missing from the samples still need a code
+    usize counts[ALPHABET_SIZE];
+    for (usize i = 0; i < ALPHABET_SIZE; i++)
+        counts[i] = freqs[i] + 1;
+
+    struct htree tree;
+    struct buffer_usize freq_map = { .data = counts, .len = ALPHABET_SIZE };
+    struct buffer_hcode code_map = { .data = table->codes, .len = ALPHABET_SIZE };
+    return build_codes(&tree, freq_map, max_code_len, &code_map, freq_map, NULL) && table_build(table);
+}
+
+#define TABLE_HEADER_SIZE (countof(TABLE_MAGIC) + sizeof(u8) + sizeof(u32))
+
+bool fformat_table_write(const struct fformat_table* table, struct io_stream* out) {
+    u8 data[TABLE_HEADER_SIZE + ALPHABET_SIZE];
+    memcpy(data, TABLE_MAGIC, countof(TABLE_MAGIC));
+    data[countof(TABLE_MAGIC)] = FFORMAT_TABLE_VERSION;
+    store_u32_le(data + countof(TABLE_MAGIC) + 1, table->id);
+
+    struct buffer_hcode code_map = { .data = (struct hcode*)table->codes, .len = ALPHABET_SIZE };
+    usize size = TABLE_HEADER_SIZE + code_lengths_pack(code_map, data + TABLE_HEADER_SIZE);
+    if (io_write(out, data, size) != size) {
+        fprintf(stderr, "error: failed to write table: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+bool fformat_table_read(struct fformat_table* table, struct io_stream* in) {
+    // A table never takes more than one run per symbol
+    u8 data[TABLE_HEADER_SIZE + ALPHABET_SIZE];
+    usize len = read_full(in, data, sizeof(data));
+    if (len < TABLE_HEADER_SIZE || memcmp(data, TABLE_MAGIC, countof(TABLE_MAGIC)) != 0) {
+        fprintf(stderr, "error: table magic does not match\n");
+        return false;
+    }
+
+    if (data[countof(TABLE_MAGIC)] != FFORMAT_TABLE_VERSION) {
+        fprintf(stderr, "error: unsupported table version %u\n", data[countof(TABLE_MAGIC)]);
+        return false;
+    }
+
+    struct buffer_hcode code_map = { .data = table->codes, .len = ALPHABET_SIZE };
+    memset(table->codes, 0, sizeof(table->codes));
+    if (!code_lengths_unpack(data + TABLE_HEADER_SIZE, len - TABLE_HEADER_SIZE, &code_map))
+        return false;
+
+    for (usize i = 0; i < ALPHABET_SIZE; i++) {
+        if (table->codes[i].bit_len == 0) {
+            fprintf(stderr, "error: table has no code for symbol %zu\n", i);
+            return false;
+        }
+    }
+
+    u32 id = load_u32_le(data + countof(TABLE_MAGIC) + 1);
+    if (!hcode_canonical(&code_map) || !table_build(table))
+        return false;
+
+    if (table->id != id) {
+        fprintf(stderr, "error: table ID %08x doesn't match its codes, is the file ill formatted?\n", id);
+        return false;
+    }
+
+    return true;
+}
+
+struct hf_cctx {
+    struct fformat_options options;
+    struct block_encoder enc;
+};
+
+struct hf_cctx* hf_cctx_create(const struct fformat_options* options) {
+    if (!options_check(options))
+        return NULL;
+
+    // The encoder's buffers are carved out of the same allocation as the context
+    usize out_size = fformat_block_bound(options->block_size);
+    usize rle_size = options->rle ? rle_bound(options->block_size) : 0;
+    usize context_size = options->context ? ALPHABET_SIZE * ALPHABET_SIZE * sizeof(usize) : 0;
+    usize bwt_size = options->bwt && !options->table ? bwt_encode_scratch(options->block_size) : 0;
+    u8* arena = malloc(sizeof(struct hf_cctx) + context_size + out_size + rle_size + bwt_size);
+    if (!arena) {
+        fprintf(stderr, "error: failed to allocate compression context: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    struct hf_cctx* ctx = (struct hf_cctx*)arena;
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->options = *options;
+    ctx->options.threads = 1;
+    ctx->enc.hist_threads = 1;
+    ctx->enc.reuse = options->table_reuse > 0;
+    if (options->context)
+        ctx->enc.context.freqs = (usize*)(arena + sizeof(struct hf_cctx));
+    // The suffix array goes ahead of the byte buffers, which keeps it aligned
+    if (bwt_size)
+        ctx->enc.bwt = (struct buffer_u8) { .data = arena + sizeof(struct hf_cctx) + context_size, .len = bwt_size };
+    ctx->enc.out = (struct buffer_u8) { .data = arena + sizeof(struct hf_cctx) + context_size + bwt_size, .len = out_size };
+    if (options->rle)
+        ctx->enc.rle = (struct buffer_u8) { .data = ctx->enc.out.data + out_size, .len = rle_size };
+
+    return ctx;
+}
+
+void hf_cctx_free(struct hf_cctx* ctx) {
+    free(ctx);
+}
+
+usize hf_compress_bound(const struct hf_cctx* ctx, usize src_len) {
+    usize block_size = ctx->options.block_size;
+    usize blocks = (src_len + block_size - 1) / block_size;
+    usize last = src_len % block_size;
+
+    u8 flags = ctx->options.table ? FILE_FLAG_TABLE : 0;
+    usize size = blocks_offset(flags) + (src_len / block_size) * fformat_block_bound(block_size);
+    if (last > 0)
+        size += fformat_block_bound(last);
+
+    return size + BLOCK_HEADER_SIZE + blocks * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE;
+}
+
+bool hf_compress(struct hf_cctx* ctx, u8* dst, usize dst_capacity, const u8* src, usize src_len, usize* dst_len) {
+    *dst_len = 0;
+    u8 flags = ctx->options.table ? FILE_FLAG_TABLE : 0;
+    usize data_offset = blocks_offset(flags);
+    if (dst_capacity < data_offset) {
+        fprintf(stderr, "error: output buffer is too small\n");
+        return false;
+    }
+
+    usize block_size = ctx->options.block_size;
+    memcpy(dst, FILE_MAGIC, countof(FILE_MAGIC));
+    dst[countof(FILE_MAGIC)] = FFORMAT_VERSION_BLOCKS;
+    dst[countof(FILE_MAGIC) + 1] = flags;
+    store_u32_le(dst + countof(FILE_MAGIC) + 2, (u32)block_size);
+    store_u64_le(dst + ORIGINAL_SIZE_OFFSET, src_len);
+    if (ctx->options.table)
+        store_u32_le(dst + FILE_HEADER_SIZE, ctx->options.table->id);
+
+    // Every archive starts with an empty table cache
+    ctx->enc.block_no = 0;
+    memset(&ctx->enc.cache, 0, sizeof(ctx->enc.cache));
+
+    usize pos = data_offset;
+    usize blocks = 0;
+    for (usize offset = 0; offset < src_len; offset += block_size) {
+        struct buffer_u8 block = {
+            .data = (u8*)src + offset,
+            .len = src_len - offset < block_size ? src_len - offset : block_size,
+        };
+
+        usize size = encode_block(&ctx->enc, &ctx->options, block, NULL);
+        if (size == 0)
+            return false;
+
+        if (size > dst_capacity - pos) {
+            fprintf(stderr, "error: output buffer is too small\n");
+            return false;
+        }
+
+        memcpy(dst + pos, ctx->enc.out.data, size);
+        pos += size;
+        blocks++;
+    }
+
+    usize payload_len = blocks * INDEX_ENTRY_SIZE + INDEX_TRAILER_SIZE;
+    if (BLOCK_HEADER_SIZE + payload_len > dst_capacity - pos) {
+        fprintf(stderr, "error: output buffer is too small\n");
+        return false;
+    }
+
+    u8* p = dst + pos;
+    p[0] = BLOCK_END;
+    p[1] = 0;
+    store_u32_le(p + 2, 0);
+    store_u32_le(p + 6, (u32)payload_len);
+    p += BLOCK_HEADER_SIZE;
+
+    // The index is rebuilt from the headers of the blocks that were just
+    // written, so it doesn't need memory of its own
+    struct fformat_block entry = { .offset = data_offset };
+    for (usize i = 0; i < blocks; i++) {
+        const u8* header = dst + entry.offset;
+        entry.raw_len = load_u32_le(header + 2);
+        entry.size = BLOCK_HEADER_SIZE + load_u32_le(header + 6);
+        store_index_entry(p, entry);
+        p += INDEX_ENTRY_SIZE;
+
+        entry.offset += entry.size;
+        entry.raw_offset += entry.raw_len;
+    }
+
+    store_u64_le(p, blocks);
+    memcpy(p + sizeof(u64), INDEX_MAGIC, countof(INDEX_MAGIC));
+
+    *dst_len = pos + BLOCK_HEADER_SIZE + payload_len;
+    return true;
+}
+
+struct hf_dctx {
+    usize max_block_size;
+    const struct fformat_table* table;
+    struct block_decoder dec;
+};
+
+struct hf_dctx* hf_dctx_create(usize max_block_size, const struct fformat_table* table) {
+    if (max_block_size < FFORMAT_MIN_BLOCK_SIZE || max_block_size > FFORMAT_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "error: block size must be between %d and %d bytes\n", FFORMAT_MIN_BLOCK_SIZE, FFORMAT_MAX_BLOCK_SIZE);
+        return NULL;
+    }
+
+    // Run-length and Burrows-Wheeler coded blocks never need more scratch
+    // memory than this, so the decoder never grows it
+    usize rle_size = rle_bound(max_block_size);
+    usize bwt_size = bwt_decode_scratch(max_block_size);
+    usize context_size = FFORMAT_MAX_CONTEXT_TABLES * sizeof(struct hdecoder);
+    u8* arena = malloc(sizeof(struct hf_dctx) + context_size + rle_size + bwt_size);
+    if (!arena) {
+        fprintf(stderr, "error: failed to allocate decompression context: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    struct hf_dctx* ctx = (struct hf_dctx*)arena;
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->max_block_size = max_block_size;
+    ctx->table = table;
+    ctx->dec.contexts = (struct hdecoder*)(arena + sizeof(struct hf_dctx));
+    ctx->dec.bwt = (struct buffer_u8) { .data = arena + sizeof(struct hf_dctx) + context_size, .len = bwt_size };
+    ctx->dec.rle = (struct buffer_u8) { .data = ctx->dec.bwt.data + bwt_size, .len = rle_size };
+
+    return ctx;
+}
+
+void hf_dctx_free(struct hf_dctx* ctx) {
+    free(ctx);
+}
+
+bool hf_decompress(struct hf_dctx* ctx, u8* dst, usize dst_capacity, const u8* src, usize src_len, usize* dst_len) {
+    *dst_len = 0;
+    if (src_len < FILE_HEADER_SIZE || memcmp(src, FILE_MAGIC, countof(FILE_MAGIC)) != 0) {
+        fprintf(stderr, "error: file magic does not match\n");
+        return false;
+    }
+
+    if (src[countof(FILE_MAGIC)] != FFORMAT_VERSION_BLOCKS) {
+        fprintf(stderr, "error: only version %d archives can be decompressed with a context\n", FFORMAT_VERSION_BLOCKS);
+        return false;
+    }
+
+    struct fformat_index header = {
+        .flags = src[countof(FILE_MAGIC) + 1],
+        .block_size = load_u32_le(src + countof(FILE_MAGIC) + 2),
+        .original_size = load_u64_le(src + ORIGINAL_SIZE_OFFSET),
+    };
+
+    if (header.flags & ~FILE_FLAG_TABLE) {
+        fprintf(stderr, "error: unknown archive flags 0x%02x\n", header.flags);
+        return false;
+    }
+
+    usize pos = blocks_offset(header.flags);
+    if (src_len < pos) {
+        fprintf(stderr, "error: unexpected end of archive\n");
+        return false;
+    }
+
+    if (header.flags & FILE_FLAG_TABLE)
+        header.table_id = load_u32_le(src + FILE_HEADER_SIZE);
+
+    ctx->dec.table = ctx->table;
+    if (!archive_table(&header, &ctx->dec.table))
+        return false;
+
+    u32 block_size = header.block_size;
+    u64 original_size = header.original_size;
+    if (block_size > ctx->max_block_size) {
+        fprintf(stderr, "error: archive has blocks of %u bytes, larger than the context's %zu\n", block_size, ctx->max_block_size);
+        return false;
+    }
+
+    if (original_size != FFORMAT_UNKNOWN_SIZE && original_size > dst_capacity) {
+        fprintf(stderr, "error: output buffer is too small\n");
+        return false;
+    }
+
+    // Repeat blocks only refer to blocks of their own archive
+    ctx->dec.loaded = 0;
+    memset(&ctx->dec.cache, 0, sizeof(ctx->dec.cache));
+
+    usize total = 0, blocks = 0;
+    for (;;) {
+        if (src_len - pos < BLOCK_HEADER_SIZE) {
+            fprintf(stderr, "error: unexpected end of archive\n");
+            return false;
+        }
+
+        const u8* header = src + pos;
+        u32 raw_len = load_u32_le(header + 2);
+        u32 payload_len = load_u32_le(header + 6);
+        if (header[0] == BLOCK_END)
+            break;
+
+        if (raw_len > block_size || payload_len > src_len - pos - BLOCK_HEADER_SIZE) {
+            fprintf(stderr, "error: block is larger than the block size, is the file ill formatted?\n");
+            return false;
+        }
+
+        if (raw_len > dst_capacity - total) {
+            fprintf(stderr, "error: output buffer is too small\n");
+            return false;
+        }
+
+        if (!decode_block(&ctx->dec, header[0], header[1], blocks, header + BLOCK_HEADER_SIZE, payload_len, dst + total, raw_len))
+            return false;
+
+        total += raw_len;
+        blocks++;
+        pos += BLOCK_HEADER_SIZE + payload_len;
+    }
+
+    if (original_size != FFORMAT_UNKNOWN_SIZE && total != original_size) {
+        fprintf(stderr, "error: archive holds %zu bytes but its header says %llu\n", total, (unsigned long long)original_size);
+        return false;
     }
 
+    *dst_len = total;
     return true;
 }
@@ -13,25 +13,211 @@
 
   > All offset/size/length fields are defined in bytes (8-bits)
   > All multi-byte values are stored as little-endian byte order
+  > Bitstreams are stored MSB-first, the last byte is padded with zero bits
 
-  The format has three sections:
-  - Header: Metadata
-  - Code Descriptors: Maps each byte to its corresponding Huffman's code
-  - Content: The compressed data
+  Every archive starts with the signature { 0x0, 0x6c, 0x62, 0x63, 0x61 } -> \0lbca, followed by
+  a single byte with the format version. Versions 0 and 1 are still read but no longer written.
+
+  ===== Version 2 =====
+
+  The input is split into blocks of at most **Block size** bytes. Every block carries its own
+  code lengths table, so the codes adapt to the local statistics, and blocks can be compressed
+  and decompressed one at a time in bounded memory.
 
   * File Header *
   +--------+-------+---------------------------------------------------------------------+
   | Offset | Bytes | Description                                                         |
   +--------+-------+---------------------------------------------------------------------+
-  | 0      | 4     | File signature = { 0x0, 0x6c, 0x62, 0x63, 0x61, 0x0 }  ->  \0lbca   |
+  | 0      | 5     | File signature                                                      |
+  +--------+-------+---------------------------------------------------------------------+
+  | 5      | 1     | Version = 2                                                         |
+  +--------+-------+---------------------------------------------------------------------+
+  | 6      | 1     | Flags (see enum file_flags)                                         |
+  +--------+-------+---------------------------------------------------------------------+
+  | 7      | 4     | Block size, the largest uncompressed size of a block                |
+  +--------+-------+---------------------------------------------------------------------+
+  | 11     | 8     | Original file size, 0xFFFFFFFFFFFFFFFF if unknown (see below)       |
+  +--------+-------+---------------------------------------------------------------------+
+
+  The original file size is written once all the input was compressed. Archives written to a
+  stream that can't seek (like a pipe) keep the unknown size, their end block marks where the
+  data ends and the block index still has the size of every block.
+
+  When FILE_FLAG_TABLE is set, the header is followed by the ID (u32) of the static table the
+  archive was compressed with (see Static Tables below).
+
+  The header is followed by a sequence of blocks, the last one is always an end block.
+
+  * Block *
+  +--------+-------+---------------------------------------------------------------------+
+  | Offset | Bytes | Description                                                         |
+  +--------+-------+---------------------------------------------------------------------+
+  | 0      | 1     | Block type (see enum block_type)                                    |
+  +--------+-------+---------------------------------------------------------------------+
+  | 1      | 1     | Block flags (see enum block_flags)                                  |
+  +--------+-------+---------------------------------------------------------------------+
+  | 2      | 4     | Uncompressed size of the block                                      |
+  +--------+-------+---------------------------------------------------------------------+
+  | 6      | 4     | Payload size (N)                                                    |
+  +--------+-------+---------------------------------------------------------------------+
+  | 10     | N     | Payload                                                             |
+  +--------+-------+---------------------------------------------------------------------+
+
+  The payload of a Huffman block is a code lengths table (as in version 1) followed by the
+  bitstream. The payload of a stored block is the uncompressed content, as it is, and the
+  payload of a single symbol block is the one byte its content repeats.
+
+  * Static Tables *
+  A static table is a code table trained ahead of time on content like the one that gets
+  compressed, and shared by both sides out of band. Static blocks are Huffman blocks coded with
+  the static table named in the file header, their payload is the same as the one of a Huffman
+  block without the code lengths table. Tables are stored in files of their own:
+
+  +--------+-------+---------------------------------------------------------------------+
+  | Offset | Bytes | Description                                                         |
+  +--------+-------+---------------------------------------------------------------------+
+  | 0      | 5     | Table signature = { 0x0, 0x6c, 0x62, 0x63, 0x74 } -> \0lbct         |
+  +--------+-------+---------------------------------------------------------------------+
+  | 5      | 1     | Version = 0                                                         |
+  +--------+-------+---------------------------------------------------------------------+
+  | 6      | 4     | Table ID, the 32-bit FNV-1a hash of the 256 code lengths            |
+  +--------+-------+---------------------------------------------------------------------+
+  | 10     | N     | Code lengths table, every symbol has a code                         |
+  +--------+-------+---------------------------------------------------------------------+
+
+  * Repeat Blocks *
+  Consecutive blocks often have about the same statistics. A repeat block is a Huffman block
+  that reuses the code table of an earlier Huffman block instead of storing its own: its code
+  lengths table is replaced by the distance (u32) in blocks back to that Huffman block, which
+  must be one of the last FFORMAT_TABLE_CACHE Huffman blocks before it.
+
+  * Context Blocks *
+  A context block codes every byte with one of up to FFORMAT_MAX_CONTEXT_TABLES code tables,
+  picked by the byte before it (its context). Contexts with about the same statistics share a
+  table. With S streams, the N coded bytes are split in S parts, part k going from byte
+  k*N/S (rounded down) to the start of the next part, and every part is coded in a stream of
+  its own. The first byte of every part has context 0.
+
+  +--------+-------+---------------------------------------------------------------------+
+  | Offset | Bytes | Description                                                         |
+  +--------+-------+---------------------------------------------------------------------+
+  | 0      | 1     | Number of tables (T)                                                |
+  +--------+-------+---------------------------------------------------------------------+
+  | 1      | N     | Context map, the table of every context from 0 to 255, stored as    |
+  |        |       | runs: the high nibble of each byte is the table, the low nibble the |
+  |        |       | run length minus one                                                |
+  +--------+-------+---------------------------------------------------------------------+
+  | 1+N    | ...   | T code lengths tables, then the streams as in Interleaved Streams   |
+  +--------+-------+---------------------------------------------------------------------+
+
+  * Run-Length Coding *
+  When BLOCK_FLAG_RLE is set, the Huffman codes encode the content after run-length coding,
+  and the payload starts with the run-length coded size (u32), followed by the code lengths
+  table. Runs are coded as 4 equal bytes followed by a byte with how many more times the byte
+  repeats (0 to 255). Fewer than 4 equal bytes are stored as they are.
+
+  * Burrows-Wheeler Coding *
+  When BLOCK_FLAG_BWT is set, the Huffman codes encode the content after the Burrows-Wheeler
+  transform, move-to-front and zero-run coding, and the payload starts with the coded size (u32)
+  and the row of the content among its sorted rotations (u32), followed by the code lengths
+  table. BLOCK_FLAG_BWT and BLOCK_FLAG_RLE are never both set.
+
+  The rotations are sorted with a sentinel after the content, smaller than any byte, so row 0
+  starts with the sentinel and the content is at a row from 1 to N. The transform is the last
+  byte of every row, in order, without the sentinel. Every byte of it is then coded as its
+  position in a list of the 256 bytes, most recent first, starting from 0 to 255 in order.
+  Runs of position 0 are coded as their length in bijective base 2, least significant digit
+  first, with the digits 1 and 2 as the bytes 0 and 1. Positions 1 to 253 are coded as the
+  position plus one, 254 and 255 as 255 followed by the position minus 254.
+
+  * Interleaved Streams *
+  When the block flags set more than one stream (S), symbol i of the block is encoded in
+  stream i % S, so the streams can be decoded side by side. The code lengths table is
+  followed by the size of every stream but the last, then by the streams, in order.
+
+  +--------+-------+---------------------------------------------------------------------+
+  | Offset | Bytes | Description                                                         |
+  +--------+-------+---------------------------------------------------------------------+
+  | 0      | N     | Code lengths table                                                  |
+  +--------+-------+---------------------------------------------------------------------+
+  | N      | 4*S-4 | Size of streams 0 to S-2                                            |
+  +--------+-------+---------------------------------------------------------------------+
+  | N+4*S-4| ...   | Streams 0 to S-1, the last one goes until the end of the payload    |
+  +--------+-------+---------------------------------------------------------------------+
+
+  * End Block *
+  The end block has an uncompressed size of 0, and its payload is the block index, which lets
+  readers find any block without going through the ones before it.
+
+  +--------+-------+---------------------------------------------------------------------+
+  | Offset | Bytes | Description                                                         |
+  +--------+-------+---------------------------------------------------------------------+
+  | 0      | 24*N  | One entry per block, in order (see below)                           |
+  +--------+-------+---------------------------------------------------------------------+
+  | 24*N   | 8     | Number of blocks (N)                                                |
+  +--------+-------+---------------------------------------------------------------------+
+  | 24*N+8 | 4     | Index signature = { 0x6c, 0x62, 0x63, 0x69 } -> lbci                |
+  +--------+-------+---------------------------------------------------------------------+
+
+  The index always ends the archive, so it is found by reading the last 12 bytes of the file.
+
+  * Index Entry *
+  +--------+-------+---------------------------------------------------------------------+
+  | Offset | Bytes | Description                                                         |
+  +--------+-------+---------------------------------------------------------------------+
+  | 0      | 8     | Offset of the block in the archive                                  |
   +--------+-------+---------------------------------------------------------------------+
-  | 4      | 8     | Original file size                                                  |
+  | 8      | 8     | Offset of the block's content in the original file                  |
   +--------+-------+---------------------------------------------------------------------+
-  | 12     | 4     | The offset (in bytes) where the compressed data starts, relative to |
+  | 16     | 4     | Uncompressed size of the block                                      |
+  +--------+-------+---------------------------------------------------------------------+
+  | 20     | 4     | Size of the block in the archive, header included                   |
+  +--------+-------+---------------------------------------------------------------------+
+
+  ===== Version 1 =====
+
+  Codes are canonical (see hcode_canonical), so only the length of each code is stored.
+
+  * File Header *
+  +--------+-------+---------------------------------------------------------------------+
+  | Offset | Bytes | Description                                                         |
+  +--------+-------+---------------------------------------------------------------------+
+  | 0      | 5     | File signature                                                      |
+  +--------+-------+---------------------------------------------------------------------+
+  | 5      | 1     | Version = 1                                                         |
+  +--------+-------+---------------------------------------------------------------------+
+  | 6      | 8     | Original file size                                                  |
+  +--------+-------+---------------------------------------------------------------------+
+  | 14     | N     | Code lengths table                                                  |
+  +--------+-------+---------------------------------------------------------------------+
+
+  * Code Lengths Table *
+  The code length of every symbol from 0 to 255, in order, stored as runs of equal lengths.
+  Each byte is a run, the high nibble is the code length (0 = symbol not used, so code
+  lengths are limited to 15 bits) and the low nibble is the run length minus one. The table
+  ends after the run that reaches symbol 255.
+
+  * Content (Compressed Data) *
+  The bitstream starts right after the code lengths table and goes until the end of the file.
+
+  ===== Version 0 =====
+
+  * File Header *
+  +--------+-------+---------------------------------------------------------------------+
+  | Offset | Bytes | Description                                                         |
+  +--------+-------+---------------------------------------------------------------------+
+  | 0      | 5     | File signature                                                      |
+  +--------+-------+---------------------------------------------------------------------+
+  | 5      | 1     | Version = 0                                                         |
+  +--------+-------+---------------------------------------------------------------------+
+  | 6      | 8     | Original file size                                                  |
+  +--------+-------+---------------------------------------------------------------------+
+  | 14     | 4     | The offset (in bytes) where the compressed data starts, relative to |
   |        |       | the beginning of the file                                           |
   +--------+-------+---------------------------------------------------------------------+
 
   * Code Entries *
+  One entry per used symbol, from the end of the header up to the offset to content.
 
   +--------+-------+----------------------------------+
   | Offset | Bytes | Description                      |
@@ -62,19 +248,202 @@
 #include "huffman.h"
 #include <stdbool.h>
 
-static u8 FILE_MAGIC[6] = { 0x0, 0x6c, 0x62, 0x63, 0x61, 0x0 }; // \0lbca
+static u8 FILE_MAGIC[5] = { 0x0, 0x6c, 0x62, 0x63, 0x61 }; // \0lbca
+
+#define FFORMAT_VERSION_LEGACY 0
+#define FFORMAT_VERSION_CANONICAL 1
+#define FFORMAT_VERSION_BLOCKS 2
+
+// Longest code the code lengths table can describe
+#define FFORMAT_MAX_CODE_LEN 15
+
+#define FFORMAT_MIN_BLOCK_SIZE (4 << 10)
+#define FFORMAT_MAX_BLOCK_SIZE (64 << 20)
+#define FFORMAT_DEFAULT_BLOCK_SIZE (1 << 20)
+#define FFORMAT_MAX_THREADS 256
+#define FFORMAT_MAX_STREAMS 8
+#define FFORMAT_MAX_SAMPLE_RATE 64
+#define FFORMAT_TABLE_VERSION 0
 
-bool fformat_compress(struct io_stream* io, struct buffer_hcode code_map, struct buffer_u8* input);
-struct buffer_u8 fformat_decompress(struct io_stream* io);
+// Repeat blocks reuse the table of one of this many previous Huffman blocks
+#define FFORMAT_TABLE_CACHE 4
 
-struct bitstream {
-    u8* data;
-    usize capacity;
-    usize byte_pos;
-    u8 bit_pos;
+// Context blocks cluster their contexts into at most this many tables
+#define FFORMAT_MAX_CONTEXT_TABLES 8
+
+// Original size of archives that were written to a stream that can't seek
+#define FFORMAT_UNKNOWN_SIZE UINT64_MAX
+
+enum block_type {
+    BLOCK_END = 0,
+    BLOCK_HUFFMAN = 1,
+    BLOCK_STORED = 2,  // content that doesn't compress, copied as it is
+    BLOCK_SINGLE = 3,  // content made of a single repeated byte
+    BLOCK_STATIC = 4,  // Huffman coded with the archive's static table
+    BLOCK_REPEAT = 5,  // Huffman coded with the table of a previous block
+    BLOCK_CONTEXT = 6, // Huffman coded with a table per context
 };
 
-void bitstream_write_bits(struct bitstream* bs, u16 bits, u8 bit_len);
-bool bitstream_read_bit(struct bitstream* bs, u8* out_bit);
+enum file_flags {
+    FILE_FLAG_TABLE = 0x1, // blocks may use a static table, its ID follows the header
+};
+
+// A code table trained ahead of time, see Static Tables above. Every symbol
+// has a code, so any content can be coded with it.
+struct fformat_table {
+    u32 id;
+    struct hcode codes[ALPHABET_SIZE];
+    struct hdecoder decoder;
+};
+
+enum block_flags {
+    BLOCK_FLAG_STREAMS = 0x7, // number of interleaved streams minus one
+    BLOCK_FLAG_RLE = 0x8,     // runs were coded ahead of the Huffman codes
+    BLOCK_FLAG_BWT = 0x10,    // Burrows-Wheeler coded ahead of the Huffman codes
+};
+
+struct fformat_options {
+    usize block_size;
+    u8 max_code_len;
+    usize threads; // blocks compressed at the same time
+    u8 streams;    // interleaved bitstreams per block, 1, 4 or 8
+    // Code tables are built from one chunk out of every `sample_rate` of a
+    // block, 1 counts every byte
+    usize sample_rate;
+    // Blocks Huffman coding wouldn't make at least this many percent smaller
+    // are stored instead
+    u8 min_saving;
+    bool rle; // run-length code blocks ahead of the Huffman codes
+    // Blocks reuse the table of a recent block when it codes them within this
+    // many percent of their entropy, 0 always builds a new table. Only blocks
+    // compressed one after another, on a single thread, reuse tables.
+    u8 table_reuse;
+    // Codes every block with this table instead of building one per block,
+    // which skips counting the symbols and building the tree
+    const struct fformat_table* table;
+    // Codes blocks with context blocks when they are smaller than Huffman
+    // blocks, see Context Blocks above. Ignored with a static table.
+    bool context;
+    // Burrows-Wheeler codes blocks ahead of the Huffman codes when that makes
+    // them smaller, see Burrows-Wheeler Coding above. Ignored with a static table.
+    bool bwt;
+};
+
+// Filled in by fformat_compress
+struct fformat_stats {
+    u64 input_size;
+    u64 output_size;
+    u64 blocks;
+    u64 content_bits;   // bits spent on the encoded symbols
+    u64 unlimited_bits; // the same without the code length limit
+    u64 exact_bits;     // the same with code tables built from every byte
+    u64 stored_blocks;  // blocks stored without compression, not in the bits above
+    u64 reused_blocks;  // blocks coded with the table of a previous block
+    u64 context_blocks; // blocks coded with a table per context
+    u64 bwt_blocks;     // blocks Burrows-Wheeler coded ahead of the Huffman codes
+};
+
+// A block index entry, offsets and sizes as described above
+struct fformat_block {
+    u64 offset;
+    u64 raw_offset;
+    u32 raw_len;
+    u32 size;
+};
+
+// The block index of a version 2 archive, free it with buffer_free
+struct fformat_index {
+    struct fformat_block* data;
+    usize len;
+    u32 block_size;
+    u64 original_size;
+    u8 flags;
+    u32 table_id; // when flags has FILE_FLAG_TABLE
+};
+
+struct fformat_options fformat_default_options(void);
+
+// The largest size a compressed block (header included) can have
+usize fformat_block_bound(usize block_size);
+
+// Reads `in` until its end and writes a version 2 archive to `out`. Neither
+// stream has to be seekable, when `out` is the original size is written once
+// all the input was read. `stats` can be NULL.
+bool fformat_compress(struct io_stream* out, struct io_stream* in, const struct fformat_options* options, struct fformat_stats* stats);
+
+// Same as fformat_compress, reading the blocks straight from `input` instead of
+// copying them out of a stream
+bool fformat_compress_memory(struct io_stream* out, const struct buffer_u8* input, const struct fformat_options* options, struct fformat_stats* stats);
+
+// Decompresses an archive of any version from `in` to `out`. With more than one
+// thread, version 2 archives with a block index are decoded on a thread pool.
+// Version 2 archives can be read from a stream that can't seek, in which case
+// the blocks are decoded in order. `table` is the static table archives
+// compressed with one need, it can be NULL.
+bool fformat_decompress(struct io_stream* out, struct io_stream* in, usize threads, const struct fformat_table* table);
+
+// Same as fformat_decompress, decoding straight into `output`, which must be
+// exactly as large as the original file (see fformat_original_size)
+bool fformat_decompress_into(struct buffer_u8* output, struct io_stream* in, usize threads, const struct fformat_table* table);
+
+// Reads the original file size from the header of an archive of any version,
+// then seeks `in` back to its start. The size is FFORMAT_UNKNOWN_SIZE for
+// archives that were streamed.
+bool fformat_original_size(struct io_stream* in, u64* size);
+
+// Same as fformat_compress and fformat_decompress, from one memory buffer to
+// another. `output` is allocated by these functions and must be freed with
+// buffer_free, also on failure.
+bool fformat_compress_buffer(struct buffer_u8* output, struct buffer_u8* input, const struct fformat_options* options);
+bool fformat_decompress_buffer(struct buffer_u8* output, struct buffer_u8* input, usize threads, const struct fformat_table* table);
+
+// Reads the header and block index of a version 2 archive
+bool fformat_read_index(struct io_stream* in, struct fformat_index* index);
+
+// Decodes the bytes [offset, offset + len) of the original file into `out`,
+// only touching the blocks that overlap the range. The range is cut short at
+// the end of the original file. `out` must be freed with buffer_free.
+bool fformat_read_range(struct io_stream* in, const struct fformat_index* index, const struct fformat_table* table,
+    u64 offset, usize len, struct buffer_u8* out);
+
+// Trains a static table on the symbol frequencies of sample content (ALPHABET_SIZE
+// entries). Symbols missing from the samples still get a code.
+bool fformat_table_train(struct fformat_table* table, const usize* freqs, u8 max_code_len);
+
+// Write and read the table file described above
+bool fformat_table_write(const struct fformat_table* table, struct io_stream* out);
+bool fformat_table_read(struct fformat_table* table, struct io_stream* in);
+
+// Contexts for compressing and decompressing many small archives in memory. A
+// context owns all the scratch memory it needs, allocated once when it is
+// created, so hf_compress and hf_decompress never allocate. Contexts can be
+// reused for any number of calls, but only by one thread at a time.
+struct hf_cctx;
+struct hf_dctx;
+
+// Blocks are compressed on the calling thread, options->threads is ignored.
+// options->table must outlive the context.
+// Returns NULL if the options are invalid or on allocation failure.
+struct hf_cctx* hf_cctx_create(const struct fformat_options* options);
+void hf_cctx_free(struct hf_cctx*);
+
+// The largest archive hf_compress can write for `src_len` bytes
+usize hf_compress_bound(const struct hf_cctx*, usize src_len);
+
+// Writes a version 2 archive of `src` to `dst`, and its size to `dst_len`.
+// Fails if the archive doesn't fit in `dst_capacity` bytes.
+bool hf_compress(struct hf_cctx*, u8* dst, usize dst_capacity, const u8* src, usize src_len, usize* dst_len);
+
+// Decompresses version 2 archives with blocks of up to `max_block_size` bytes.
+// The context takes about 6 times that much memory, most of it for
+// Burrows-Wheeler coded blocks.
+// `table` is the static table archives compressed with one need, it can be NULL
+// and must outlive the context otherwise.
+struct hf_dctx* hf_dctx_create(usize max_block_size, const struct fformat_table* table);
+void hf_dctx_free(struct hf_dctx*);
+
+// Decodes the archive in `src` to `dst`, and its size to `dst_len`. Fails if
+// the content doesn't fit in `dst_capacity` bytes.
+bool hf_decompress(struct hf_dctx*, u8* dst, usize dst_capacity, const u8* src, usize src_len, usize* dst_len);
 
 #endif
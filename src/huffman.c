@@ -10,11 +10,114 @@
 
 #include "huffman.h"
 #include <errno.h>
+#include <pthread.h>
+
+// Counts are spread over several tables, so a run of the same byte doesn't have
+// every increment wait on the store of the previous one. The tables are summed
+// once the data was counted.
+#define HIST_TABLES 8
+
+// The tables hold 32-bit counts, larger inputs are counted in parts
+#define HIST_MAX_PART ((usize)1 << 30)
+
+// Parts smaller than this aren't worth a thread of their own
+#define HIST_MIN_THREAD_PART ((usize)1 << 20)
+
+// Size of the chunks frequencies_sample counts
+#define HIST_SAMPLE_CHUNK ((usize)1 << 10)
+
+#define HIST_BROADCAST 0x0101010101010101ull
+
+static inline void histogram_word(u32 counts[HIST_TABLES][ALPHABET_SIZE], u64 word) {
+    counts[0][(u8)word]++;
+    counts[1][(u8)(word >> 8)]++;
+    counts[2][(u8)(word >> 16)]++;
+    counts[3][(u8)(word >> 24)]++;
+    counts[4][(u8)(word >> 32)]++;
+    counts[5][(u8)(word >> 40)]++;
+    counts[6][(u8)(word >> 48)]++;
+    counts[7][(u8)(word >> 56)]++;
+}
+
+static void histogram_scalar(const u8* data, usize len, u32 counts[HIST_TABLES][ALPHABET_SIZE]) {
+    usize i = 0;
+    for (; i + 8 <= len; i += 8) {
+        u64 word;
+        memcpy(&word, data + i, sizeof(word));
+
+        // A word of a single repeated byte is counted with one add
+        if (word == data[i] * HIST_BROADCAST)
+            counts[0][data[i]] += 8;
+        else
+            histogram_word(counts, word);
+    }
+
+    for (; i < len; i++)
+        counts[0][data[i]]++;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HIST_AVX2
+
+// Bytes can't be counted with vector instructions, but a single compare tells
+// whether 32 bytes are all the same, which zero padding and long runs are
+__attribute__((target("avx2"))) static void histogram_avx2(const u8* data, usize len, u32 counts[HIST_TABLES][ALPHABET_SIZE]) {
+    usize i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i first = _mm256_set1_epi8((char)data[i]);
+        if ((u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, first)) == 0xffffffffu) {
+            counts[0][data[i]] += 32;
+            continue;
+        }
+
+        u64 words[4];
+        _mm256_storeu_si256((__m256i*)words, bytes);
+        histogram_word(counts, words[0]);
+        histogram_word(counts, words[1]);
+        histogram_word(counts, words[2]);
+        histogram_word(counts, words[3]);
+    }
+
+    histogram_scalar(data + i, len - i, counts);
+}
+#endif
+
+static void histogram_count(const u8* data, usize len, u32 counts[HIST_TABLES][ALPHABET_SIZE]) {
+#ifdef HIST_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        histogram_avx2(data, len, counts);
+        return;
+    }
+#endif
+
+    histogram_scalar(data, len, counts);
+}
+
+static void histogram_merge(u32 counts[HIST_TABLES][ALPHABET_SIZE], usize* freqs) {
+    for (usize t = 0; t < HIST_TABLES; t++) {
+        for (usize c = 0; c < ALPHABET_SIZE; c++)
+            freqs[c] += counts[t][c];
+    }
+}
+
+// Adds the byte counts of `data` to `freqs`
+static void histogram_add(const u8* data, usize len, usize* freqs) {
+    u32 counts[HIST_TABLES][ALPHABET_SIZE];
+
+    for (usize offset = 0; offset < len; offset += HIST_MAX_PART) {
+        usize part = len - offset < HIST_MAX_PART ? len - offset : HIST_MAX_PART;
+        memset(counts, 0, sizeof(counts));
+        histogram_count(data + offset, part, counts);
+        histogram_merge(counts, freqs);
+    }
+}
 
 struct buffer_usize frequencies_build(struct buffer_u8* input) {
     struct buffer_usize buf = { 0 };
 
-    const usize freqs_size = UINT8_MAX;
+    const usize freqs_size = ALPHABET_SIZE;
     usize* freqs = calloc(freqs_size, sizeof(usize));
 
     if (freqs == NULL) {
@@ -22,10 +125,7 @@ struct buffer_usize frequencies_build(struct buffer_u8* input) {
         return buf;
     }
 
-    for (usize i = 0; i < input->len; i++) {
-        u8 c = input->data[i];
-        freqs[c]++;
-    }
+    frequencies_count(input, freqs);
 
     buf.data = freqs;
     buf.len = freqs_size;
@@ -33,83 +133,164 @@ struct buffer_usize frequencies_build(struct buffer_u8* input) {
     return buf;
 }
 
-int pkey_cmp(const void* a, const void* b) {
-    struct helement* ka = *(struct helement* const*)a;
-    struct helement* kb = *(struct helement* const*)b;
-
-    if (ka->frequency > kb->frequency)
-        return -1;
-    else if (ka->frequency < kb->frequency)
-        return 1;
-    else
-        return 0;
+void frequencies_count(struct buffer_u8* input, usize* freqs) {
+    memset(freqs, 0, ALPHABET_SIZE * sizeof(usize));
+    histogram_add(input->data, input->len, freqs);
 }
 
-void pqueue_sort(struct pqueue* queue) {
-    qsort(queue->items, queue->len, sizeof(struct helement*), pkey_cmp);
+void frequencies_sample(struct buffer_u8* input, usize rate, usize* freqs) {
+    memset(freqs, 0, ALPHABET_SIZE * sizeof(usize));
+
+    // Counts one chunk out of every `rate`, the chunks are large enough to
+    // still be read a cache line at a time
+    u32 counts[HIST_TABLES][ALPHABET_SIZE];
+    usize stride = HIST_SAMPLE_CHUNK * rate;
+
+    for (usize offset = 0; offset < input->len; offset += HIST_MAX_PART) {
+        usize part = input->len - offset < HIST_MAX_PART ? input->len - offset : HIST_MAX_PART;
+        memset(counts, 0, sizeof(counts));
+
+        for (usize i = 0; i < part; i += stride) {
+            usize len = part - i < HIST_SAMPLE_CHUNK ? part - i : HIST_SAMPLE_CHUNK;
+            histogram_count(input->data + offset + i, len, counts);
+        }
+
+        histogram_merge(counts, freqs);
+    }
+
+    // Scales the sample up to the whole input. Every byte gets at least a count
+    // of one, so bytes the sample missed still have a code.
+    for (usize c = 0; c < ALPHABET_SIZE; c++)
+        freqs[c] = freqs[c] * rate + 1;
 }
 
-struct helement* helement_make(u8 byte, usize frequency) {
-    struct helement* new = calloc(1, sizeof(struct helement));
-    if (!new) {
-        fprintf(stderr, "failed to allocate tree node: %s\n", strerror(errno));
-        return NULL;
+void frequencies_add_order1(struct buffer_u8* input, usize* freqs) {
+    u8 prev = 0;
+    for (usize i = 0; i < input->len; i++) {
+        freqs[prev * ALPHABET_SIZE + input->data[i]]++;
+        prev = input->data[i];
     }
+}
 
-    new->byte = byte;
-    new->frequency = frequency;
-    return new;
+struct histogram_part {
+    pthread_t thread;
+    bool started;
+    const u8* data;
+    usize len;
+    usize freqs[ALPHABET_SIZE];
+};
+
+static void* histogram_part_run(void* arg) {
+    struct histogram_part* part = arg;
+    histogram_add(part->data, part->len, part->freqs);
+    return NULL;
 }
 
-struct pqueue pqueue_build(struct buffer_usize frequencies) {
-    usize count = UINT8_MAX;
-    struct pqueue q = {
-        .items = calloc(count, sizeof(struct helement*)),
-        .count = count,
-        .len = 0,
-    };
+bool frequencies_count_parallel(struct buffer_u8* input, usize threads, usize* freqs) {
+    if (threads > input->len / HIST_MIN_THREAD_PART)
+        threads = input->len / HIST_MIN_THREAD_PART;
 
-    if (!q.items) {
-        fprintf(stderr, "failed to allocate priority queue memory: %s\n", strerror(errno));
-        return q;
+    if (threads <= 1) {
+        frequencies_count(input, freqs);
+        return true;
     }
 
-    for (usize i = 0; i < frequencies.len; i++) {
-        usize frequency = frequencies.data[i];
-        u8 c = (u8)i;
+    struct histogram_part* parts = calloc(threads, sizeof(struct histogram_part));
+    if (!parts) {
+        fprintf(stderr, "failed to allocate frequency map: %s\n", strerror(errno));
+        return false;
+    }
+
+    memset(freqs, 0, ALPHABET_SIZE * sizeof(usize));
+
+    // The calling thread counts the first part, a part whose thread can't be
+    // started is counted here as well
+    usize part_len = input->len / threads;
+    for (usize i = 0; i < threads; i++) {
+        parts[i].data = input->data + i * part_len;
+        parts[i].len = i == threads - 1 ? input->len - i * part_len : part_len;
+        if (i > 0)
+            parts[i].started = pthread_create(&parts[i].thread, NULL, histogram_part_run, &parts[i]) == 0;
+    }
+
+    for (usize i = 0; i < threads; i++) {
+        if (parts[i].started)
+            pthread_join(parts[i].thread, NULL);
+        else
+            histogram_part_run(&parts[i]);
+
+        for (usize c = 0; c < ALPHABET_SIZE; c++)
+            freqs[c] += parts[i].freqs[c];
+    }
+
+    free(parts);
+    return true;
+}
 
+int pkey_cmp(const void* a, const void* b) {
+    struct helement* ka = *(struct helement* const*)a;
+    struct helement* kb = *(struct helement* const*)b;
+
+    if (ka->frequency < kb->frequency)
+        return -1;
+    else if (ka->frequency > kb->frequency)
+        return 1;
+    else
+        return (int)ka->byte - (int)kb->byte;
+}
+
+struct pqueue pqueue_build(struct htree* tree, struct buffer_usize frequencies) {
+    struct pqueue q = { .len = 0 };
+    tree->len = 0;
+
+    for (usize i = 0; i < frequencies.len && i < ALPHABET_SIZE; i++) {
+        usize frequency = frequencies.data[i];
         if (frequency == 0)
             continue;
 
-        q.items[q.len] = helement_make(c, frequency);
-        q.len++;
+        struct helement* leaf = &tree->nodes[tree->len++];
+        *leaf = (struct helement) { .byte = (u8)i, .frequency = frequency };
+        q.items[q.len++] = leaf;
     }
 
-    pqueue_sort(&q);
+    qsort(q.items, q.len, sizeof(struct helement*), pkey_cmp);
     return q;
 }
 
-struct helement* htree_build(struct pqueue* queue) {
-    while (queue->len > 1) {
-        struct helement* left = queue->items[queue->len - 1];
-        struct helement* right = queue->items[queue->len - 2];
-        queue->len -= 2;
+// Returns the lighter of the next leaf and the next merged node
+static struct helement* htree_take(struct htree* tree, struct pqueue* queue, usize* leaf, usize* merged) {
+    bool has_leaf = *leaf < queue->len;
+    bool has_merged = *merged < tree->len;
 
-        struct helement* merged = helement_make(0, left->frequency + right->frequency);
-        if (!merged) {
-            return NULL;
-        }
+    if (has_leaf && (!has_merged || queue->items[*leaf]->frequency <= tree->nodes[*merged].frequency))
+        return queue->items[(*leaf)++];
+
+    return &tree->nodes[(*merged)++];
+}
+
+struct helement* htree_build(struct htree* tree, struct pqueue* queue) {
+    if (queue->len == 0)
+        return NULL;
 
-        merged->left = left;
-        merged->right = right;
+    // Two-queue construction: merged nodes are created in ascending order of
+    // frequency, so the ones appended after the leaves in tree->nodes form a
+    // second sorted queue and the two lightest nodes are always at the fronts
+    usize leaf = 0;
+    usize merged = tree->len;
 
-        queue->items[queue->len] = merged;
-        queue->len++;
+    while ((queue->len - leaf) + (tree->len - merged) > 1) {
+        struct helement* left = htree_take(tree, queue, &leaf, &merged);
+        struct helement* right = htree_take(tree, queue, &leaf, &merged);
 
-        pqueue_sort(queue);
+        struct helement* node = &tree->nodes[tree->len++];
+        *node = (struct helement) {
+            .frequency = left->frequency + right->frequency,
+            .left = left,
+            .right = right,
+        };
     }
 
-    return queue->items[0];
+    return leaf < queue->len ? queue->items[leaf] : &tree->nodes[merged];
 }
 
 void htree_encode(struct helement* node, struct buffer_hcode* codes, u16 bits, u8 bit_len) {
@@ -128,19 +309,297 @@ void htree_encode(struct helement* node, struct buffer_hcode* codes, u16 bits, u
     }
 }
 
-void tree_free(struct helement* element) {
-    if (!element)
-        return;
+struct pm_leaf {
+    usize frequency;
+    u16 symbol;
+};
+
+static int pm_leaf_cmp(const void* a, const void* b) {
+    const struct pm_leaf* la = a;
+    const struct pm_leaf* lb = b;
 
-    tree_free(element->left);
-    tree_free(element->right);
-    free(element);
+    if (la->frequency != lb->frequency)
+        return la->frequency < lb->frequency ? -1 : 1;
+    return (int)la->symbol - (int)lb->symbol;
 }
 
-void pqueue_free(struct pqueue* queue) {
-    if (!queue)
-        return;
+bool hcode_limit(struct buffer_usize frequencies, struct buffer_hcode* codes, u8 max_len) {
+    u8 longest = 0;
+    for (usize i = 0; i < codes->len; i++) {
+        if (codes->data[i].bit_len > longest)
+            longest = codes->data[i].bit_len;
+    }
+
+    if (longest <= max_len)
+        return true;
+
+    struct pm_leaf leaves[ALPHABET_SIZE];
+    usize n = 0;
+    for (usize i = 0; i < frequencies.len && i < codes->len; i++) {
+        if (frequencies.data[i] > 0)
+            leaves[n++] = (struct pm_leaf) { .frequency = frequencies.data[i], .symbol = (u16)i };
+    }
+
+    if (max_len > HCODE_MAX_LEN || n > ((usize)1 << max_len)) {
+        fprintf(stderr, "error: %zu symbols can't have codes of at most %u bits\n", n, max_len);
+        return false;
+    }
+
+    qsort(leaves, n, sizeof(*leaves), pm_leaf_cmp);
+
+    // Package-merge: each level is the list of leaves merged with the pairs
+    // (packages) of the level below, both sorted by weight. We only ever look
+    // at the first 2n - 2 items of a level, so longer lists are cut short.
+    const usize list_max = 2 * n - 2;
+    u64 weights[2][2 * ALPHABET_SIZE];
+    u8 is_package[HCODE_MAX_LEN][2 * ALPHABET_SIZE];
+    usize list_len = 0;
+
+    for (usize i = 0; i < n && i < list_max; i++) {
+        weights[0][i] = leaves[i].frequency;
+        is_package[0][i] = 0;
+        list_len++;
+    }
+
+    for (usize level = 1; level < max_len; level++) {
+        const u64* prev = weights[(level - 1) & 1];
+        u64* cur = weights[level & 1];
+        usize packages = list_len / 2;
+        usize leaf = 0, package = 0, len = 0;
+
+        while (len < list_max && (leaf < n || package < packages)) {
+            u64 package_weight = package < packages ? prev[2 * package] + prev[2 * package + 1] : 0;
+            if (package >= packages || (leaf < n && leaves[leaf].frequency <= package_weight)) {
+                cur[len] = leaves[leaf++].frequency;
+                is_package[level][len] = 0;
+            } else {
+                cur[len] = package_weight;
+                is_package[level][len] = 1;
+                package++;
+            }
+            len++;
+        }
+
+        list_len = len;
+    }
+
+    // Walk back down: every leaf picked at a level adds one bit to its code,
+    // and every package picked pulls two items from the level below
+    u8 lengths[ALPHABET_SIZE] = { 0 };
+    usize take = list_max;
+    for (usize level = max_len; level-- > 0;) {
+        usize packages = 0;
+        for (usize i = 0; i < take; i++)
+            packages += is_package[level][i];
+
+        for (usize i = 0; i < take - packages; i++)
+            lengths[leaves[i].symbol]++;
+
+        take = 2 * packages;
+    }
+
+    for (usize i = 0; i < codes->len; i++) {
+        codes->data[i].bits = 0;
+        codes->data[i].bit_len = lengths[i];
+    }
+
+    return true;
+}
+
+u64 hcode_cost(struct buffer_usize frequencies, struct buffer_hcode codes) {
+    u64 bits = 0;
+    for (usize i = 0; i < frequencies.len && i < codes.len; i++)
+        bits += (u64)frequencies.data[i] * codes.data[i].bit_len;
+
+    return bits;
+}
+
+// log2(x) in 16.16 fixed point, x must not be 0. The fraction is found one bit
+// at a time by squaring the mantissa.
+static u64 log2_fixed(u64 x) {
+    u32 exponent = 63 - __builtin_clzll(x);
+    u64 mantissa = exponent >= 31 ? x >> (exponent - 31) : x << (31 - exponent); // 1.31
+    u64 result = (u64)exponent << 16;
+
+    for (u32 bit = 1u << 15; bit; bit >>= 1) {
+        mantissa = (mantissa * mantissa) >> 31;
+        if (mantissa >= (2ull << 31)) {
+            mantissa >>= 1;
+            result |= bit;
+        }
+    }
+
+    return result;
+}
+
+u64 frequencies_entropy(struct buffer_usize frequencies) {
+    u64 total = 0;
+    for (usize i = 0; i < frequencies.len; i++)
+        total += frequencies.data[i];
+
+    if (total == 0)
+        return 0;
+
+    u64 log_total = log2_fixed(total);
+    u64 bits = 0;
+    for (usize i = 0; i < frequencies.len; i++) {
+        if (frequencies.data[i])
+            bits += (u64)frequencies.data[i] * (log_total - log2_fixed(frequencies.data[i]));
+    }
+
+    return bits >> 16;
+}
+
+void frequencies_costs(struct buffer_usize frequencies, u32* costs) {
+    u64 total = 0;
+    for (usize i = 0; i < frequencies.len; i++)
+        total += frequencies.data[i];
+
+    // Counts are doubled so the missing symbols can have half of one
+    u64 log_total = log2_fixed(2 * total + 1);
+    for (usize i = 0; i < frequencies.len; i++) {
+        u64 count = 2 * (u64)frequencies.data[i];
+        costs[i] = (u32)(log_total - (count ? log2_fixed(count) : 0));
+    }
+}
+
+bool hcode_canonical(struct buffer_hcode* codes) {
+    u32 length_count[HCODE_MAX_LEN + 1] = { 0 };
+    for (usize sym = 0; sym < codes->len; sym++) {
+        u8 len = codes->data[sym].bit_len;
+        if (len > HCODE_MAX_LEN) {
+            fprintf(stderr, "error: code for byte '0x%02zx' is longer than %d bits\n", sym, HCODE_MAX_LEN);
+            return false;
+        }
+
+        length_count[len]++;
+    }
+
+    // The first code of each length follows the last code of the previous one
+    u32 next_code[HCODE_MAX_LEN + 1] = { 0 };
+    u32 code = 0;
+    length_count[0] = 0;
+    for (usize len = 1; len <= HCODE_MAX_LEN; len++) {
+        code = (code + length_count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+
+    for (usize sym = 0; sym < codes->len; sym++) {
+        struct hcode* c = &codes->data[sym];
+        if (c->bit_len > 0)
+            c->bits = (u16)next_code[c->bit_len]++;
+    }
+
+    return true;
+}
+
+// Every entry of the multi-symbol table chains the primary lookups of the codes
+// that fit whole in its index
+static void hdecoder_build_multi(struct hdecoder* dec) {
+    const u32 primary_bits = HDECODE_PRIMARY_BITS;
+    const u32 mask = (1u << primary_bits) - 1;
+
+    for (u32 i = 0; i < countof(dec->multi); i++) {
+        struct hdecode_multi* multi = &dec->multi[i];
+        memset(multi, 0, sizeof(*multi));
+
+        while (multi->count < HDECODE_MULTI_MAX) {
+            // Past `len`, the index only holds zeros shifted in, so a code
+            // is only known when it ends before them
+            struct hdecode_entry entry = dec->primary[(i << multi->len) & mask];
+            if (entry.len == 0 || entry.len > primary_bits - multi->len)
+                break;
+
+            multi->symbols[multi->count++] = (u8)entry.value;
+            multi->len += entry.len;
+        }
+    }
+}
+
+bool hdecoder_build(struct hdecoder* dec, struct buffer_hcode codes, usize symbols) {
+    const u32 primary_bits = HDECODE_PRIMARY_BITS;
+    memset(dec->primary, 0, sizeof(dec->primary));
+    dec->multi_symbol = false;
+
+    // First pass: find out how large the subtable of each long code prefix is
+    for (usize sym = 0; sym < codes.len; sym++) {
+        struct hcode code = codes.data[sym];
+        if (code.bit_len > HCODE_MAX_LEN) {
+            fprintf(stderr, "error: code for byte '0x%02zx' is longer than %d bits\n", sym, HCODE_MAX_LEN);
+            return false;
+        }
+
+        if (code.bit_len <= primary_bits)
+            continue;
+
+        u8 extra = code.bit_len - primary_bits;
+        struct hdecode_entry* link = &dec->primary[(code.bits & ((1u << code.bit_len) - 1)) >> extra];
+        if (extra > link->sub_bits)
+            link->sub_bits = extra;
+    }
+
+    usize offset = 0;
+    for (usize i = 0; i < countof(dec->primary); i++) {
+        struct hdecode_entry* link = &dec->primary[i];
+        if (link->sub_bits == 0)
+            continue;
+
+        usize size = (usize)1 << link->sub_bits;
+        link->value = (u16)offset;
+        memset(&dec->secondary[offset], 0, size * sizeof(struct hdecode_entry));
+        offset += size;
+    }
+
+    // Second pass: every code fills all the entries whose index starts with it
+    for (usize sym = 0; sym < codes.len; sym++) {
+        struct hcode code = codes.data[sym];
+        if (code.bit_len == 0)
+            continue;
+
+        struct hdecode_entry entry = { .value = (u16)sym, .len = code.bit_len, .sub_bits = 0 };
+        u32 bits = code.bits & ((1u << code.bit_len) - 1);
+        struct hdecode_entry* table;
+        usize first, count;
+
+        if (code.bit_len <= primary_bits) {
+            table = dec->primary;
+            first = (usize)bits << (primary_bits - code.bit_len);
+            count = (usize)1 << (primary_bits - code.bit_len);
+        } else {
+            u8 extra = code.bit_len - primary_bits;
+            struct hdecode_entry link = dec->primary[bits >> extra];
+            u32 suffix = bits & ((1u << extra) - 1);
+
+            table = &dec->secondary[link.value];
+            first = (usize)suffix << (link.sub_bits - extra);
+            count = (usize)1 << (link.sub_bits - extra);
+        }
+
+        for (usize i = first; i < first + count; i++) {
+            if (table[i].len != 0 || table[i].sub_bits != 0) {
+                fprintf(stderr, "error: code table is not prefix-free\n");
+                return false;
+            }
+
+            table[i] = entry;
+        }
+    }
+
+    if (symbols < HDECODE_MULTI_MIN_SYMBOLS)
+        return true;
+
+    // A code of length len fills 2^(primary_bits - len) primary entries, as
+    // likely as the code is, so their average is the expected code length
+    u64 covered = 0, total_len = 0;
+    for (usize i = 0; i < countof(dec->primary); i++) {
+        covered += dec->primary[i].len != 0;
+        total_len += dec->primary[i].len;
+    }
+
+    if (covered > 0 && total_len * 2 <= covered * primary_bits) {
+        hdecoder_build_multi(dec);
+        dec->multi_symbol = true;
+    }
 
-    free(queue->items);
-    queue->count = queue->len = 0;
+    return true;
 }
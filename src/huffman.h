@@ -12,6 +12,7 @@
 #define HF_HUFFMAN_H
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,6 +25,9 @@ typedef size_t usize;
 
 #define countof(a) sizeof(a) / sizeof(*a)
 
+// We work on bytes, so there are 256 possible symbols
+#define ALPHABET_SIZE 256
+
 struct buffer_u8 {
     u8* data;
     usize len;
@@ -61,14 +65,25 @@ struct helement {
     struct helement *left, *right;
 };
 
+// A full binary tree with one leaf per symbol has at most this many nodes
+#define HTREE_MAX_NODES (2 * ALPHABET_SIZE - 1)
+
+// Owns every node of a tree, so building one never allocates
+struct htree {
+    struct helement nodes[HTREE_MAX_NODES];
+    usize len;
+};
+
+// The leaves of a tree, sorted by ascending frequency
 struct pqueue {
-    struct helement** items;
-    usize count, len;
+    struct helement* items[ALPHABET_SIZE];
+    usize len;
 };
 
+// Codes are stored in a u16, so no code may be longer than this
+#define HCODE_MAX_LEN 16
+
 struct hcode {
-    // huffman codes have a max lenght of ceil(log2(n)) * 2, where n is
-    // is the alphabet size, in this case n = 256 since we work on bytes
     u16 bits;
     u8 bit_len;
 };
@@ -82,26 +97,95 @@ struct buffer_hcode {
 // value the frequencies
 struct buffer_usize frequencies_build(struct buffer_u8*);
 
-// Build a priority queue on the results of make_frequencies
-struct pqueue pqueue_build(struct buffer_usize);
+// Same as frequencies_build, counting into `freqs` (ALPHABET_SIZE entries)
+// instead of allocating the frequency map
+void frequencies_count(struct buffer_u8*, usize* freqs);
 
-// Compare two pkey, 0 -> equal, 1 -> f < s, -1 -> f > s
-//   where f = first, s = second
-int pkey_cmp(const void*, const void*);
+// Same as frequencies_count, splitting large inputs across up to `threads`
+// threads. Returns false if the threads' counts can't be allocated.
+bool frequencies_count_parallel(struct buffer_u8*, usize threads, usize* freqs);
 
-// Sorts a priority queue based on character frequency
-void pqueue_sort(struct pqueue*);
+// Estimates the frequencies by only counting one chunk out of every `rate`.
+// Every byte gets a frequency of at least one, so all bytes can be encoded
+// with codes built from the estimate.
+void frequencies_sample(struct buffer_u8*, usize rate, usize* freqs);
 
-// Heap allocates a new huffman tree node
-struct helement* helement_make(u8, usize);
+// Adds every byte to the frequency map of the byte before it, the first byte
+// follows a 0. `freqs` holds ALPHABET_SIZE frequency maps of ALPHABET_SIZE entries.
+void frequencies_add_order1(struct buffer_u8*, usize* freqs);
 
-// Builds the tree from a priority queue
-struct helement* htree_build(struct pqueue*);
+// Resets the tree and creates one leaf for every byte that occurs in the
+// frequency map, returning the leaves as a priority queue
+struct pqueue pqueue_build(struct htree*, struct buffer_usize);
+
+// Compare two pkey, 0 -> equal, -1 -> f < s, 1 -> f > s
+//   where f = first, s = second, ties are ordered by byte
+int pkey_cmp(const void*, const void*);
+
+// Builds the tree from a priority queue in linear time, returns the root or
+// NULL if the queue is empty
+struct helement* htree_build(struct htree*, struct pqueue*);
 
 // Creates a map that maps each byte to a hcode
 void htree_encode(struct helement*, struct buffer_hcode*, u16, u8);
 
-void tree_free(struct helement*);
-void pqueue_free(struct pqueue*);
+// Makes sure no code is longer than `max_len` bits. If the tree is deeper than
+// that, the code lengths are rebuilt with package-merge, which gives the optimal
+// lengths under the limit. Only the lengths are updated, the codes need to be
+// reassigned with hcode_canonical afterwards.
+bool hcode_limit(struct buffer_usize, struct buffer_hcode*, u8 max_len);
+
+// Total size in bits of the input encoded with the given code map
+u64 hcode_cost(struct buffer_usize, struct buffer_hcode);
+
+// Shannon entropy of the frequencies in bits, the size no code can go below
+u64 frequencies_entropy(struct buffer_usize);
+
+// What coding each symbol with the frequencies costs, in 1/65536 bits. Symbols
+// that don't occur cost as much as if they occurred half a time.
+void frequencies_costs(struct buffer_usize, u32* costs);
+
+// Reassigns the codes of a code map as canonical codes, keeping the lengths:
+// shorter codes come first and codes of the same length are ordered by symbol,
+// so the code map can be rebuilt from the lengths alone
+bool hcode_canonical(struct buffer_hcode*);
+
+// Table-driven decoding: the next HDECODE_PRIMARY_BITS bits of the stream
+// index the primary table, which resolves every code up to that length in one
+// lookup. Longer codes are resolved through a second lookup in a subtable.
+#define HDECODE_PRIMARY_BITS 11
+#define HDECODE_SECONDARY_MAX (ALPHABET_SIZE << (HCODE_MAX_LEN - HDECODE_PRIMARY_BITS))
+
+struct hdecode_entry {
+    u16 value;   // the decoded symbol, or the subtable offset for links
+    u8 len;      // code length, 0 for links and invalid entries
+    u8 sub_bits; // for links, how many bits index the subtable
+};
+
+// When codes are short, the HDECODE_PRIMARY_BITS bits of a lookup usually hold
+// several of them. The multi-symbol table resolves up to HDECODE_MULTI_MAX
+// whole codes in one lookup.
+#define HDECODE_MULTI_MAX 4
+#define HDECODE_MULTI_MIN_SYMBOLS (1 << 14) // fewer don't pay for building the table
+
+struct hdecode_multi {
+    u8 symbols[HDECODE_MULTI_MAX];
+    u8 count; // decoded symbols, 0 when the first code is longer than the lookup
+    u8 len;   // total length of their codes
+};
+
+struct hdecoder {
+    struct hdecode_entry primary[1 << HDECODE_PRIMARY_BITS];
+    struct hdecode_entry secondary[HDECODE_SECONDARY_MAX];
+    struct hdecode_multi multi[1 << HDECODE_PRIMARY_BITS];
+    bool multi_symbol; // whether `multi` was built
+};
+
+// Fills the decode tables from a code map, fails if the codes are longer than
+// HCODE_MAX_LEN or are not prefix-free. The multi-symbol table is only built
+// when lookups would hold two codes on average and at least
+// HDECODE_MULTI_MIN_SYMBOLS `symbols` are going to be decoded.
+bool hdecoder_build(struct hdecoder*, struct buffer_hcode, usize symbols);
+
 
 #endif
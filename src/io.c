@@ -8,8 +8,15 @@
   along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+// for madvise and ftruncate
+#define _DEFAULT_SOURCE
+
 #include "io.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 usize io_write(struct io_stream* io, void* buffer, usize size) {
     return io->write(io->context, buffer, size);
@@ -34,6 +41,7 @@ void io_close(struct io_stream* io) {
 
 struct io_filestream {
     FILE* file;
+    bool owned; // closed with the stream
 };
 
 static usize fstream_read(void* context, void* buffer, usize size) {
@@ -58,7 +66,7 @@ static long fstream_tell(void* context) {
 
 static void fstream_close(void* context) {
     struct io_filestream* fs = context;
-    if (fs->file)
+    if (fs->file && fs->owned)
         fclose(fs->file);
     free(fs);
 }
@@ -72,22 +80,37 @@ struct io_stream io_fopen(const char* path, const char* modes) {
     }
 
     fs->file = fopen(path, modes);
+    fs->owned = true;
     if (!fs->file) {
         fprintf(stderr, "failed to open file '%s': %s\n", path, strerror(errno));
         free(fs);
         return io;
     }
 
-    if (fseek(fs->file, 0, SEEK_CUR) != 0) {
-        fprintf(stderr, "file '%s' is not seekable\n", path);
-        fclose(fs->file);
-        free(fs);
+    io.context = fs;
+    io.read = fstream_read;
+    io.write = fstream_write;
+    io.seek = fstream_seek;
+    io.tell = fstream_tell;
+    io.close = fstream_close;
+    io.valid = true;
+
+    return io;
+}
+
+struct io_stream io_fwrap(FILE* file) {
+    struct io_stream io = { 0 };
+    struct io_filestream* fs = malloc(sizeof(struct io_filestream));
+    if (!fs) {
+        fprintf(stderr, "failed to allocate file io descriptor: %s\n", strerror(errno));
         return io;
     }
 
+    fs->file = file;
+    fs->owned = false;
+
     io.context = fs;
     io.read = fstream_read;
-    io.read = fstream_read;
     io.write = fstream_write;
     io.seek = fstream_seek;
     io.tell = fstream_tell;
@@ -96,3 +119,200 @@ struct io_stream io_fopen(const char* path, const char* modes) {
 
     return io;
 }
+
+struct io_memstream {
+    struct buffer_u8* buffer;
+    usize capacity; // 0 for read-only streams
+    usize pos;
+    bool writable;
+};
+
+static usize mstream_read(void* context, void* buffer, usize size) {
+    struct io_memstream* ms = context;
+    if (ms->pos >= ms->buffer->len)
+        return 0;
+
+    usize available = ms->buffer->len - ms->pos;
+    if (size > available)
+        size = available;
+
+    memcpy(buffer, ms->buffer->data + ms->pos, size);
+    ms->pos += size;
+    return size;
+}
+
+static usize mstream_write(void* context, const void* buffer, usize size) {
+    struct io_memstream* ms = context;
+    if (!ms->writable)
+        return 0;
+
+    if (ms->pos + size > ms->capacity) {
+        usize capacity = ms->capacity ? ms->capacity : 4096;
+        while (capacity < ms->pos + size)
+            capacity *= 2;
+
+        u8* data = realloc(ms->buffer->data, capacity);
+        if (!data)
+            return 0;
+
+        ms->buffer->data = data;
+        ms->capacity = capacity;
+    }
+
+    // Seeking past the end leaves a gap, which reads back as zeroes
+    if (ms->pos > ms->buffer->len)
+        memset(ms->buffer->data + ms->buffer->len, 0, ms->pos - ms->buffer->len);
+
+    memcpy(ms->buffer->data + ms->pos, buffer, size);
+    ms->pos += size;
+    if (ms->pos > ms->buffer->len)
+        ms->buffer->len = ms->pos;
+
+    return size;
+}
+
+static int mstream_seek(void* context, long offset, int origin) {
+    struct io_memstream* ms = context;
+    long base;
+
+    switch (origin) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = (long)ms->pos;
+        break;
+    case SEEK_END:
+        base = (long)ms->buffer->len;
+        break;
+    default:
+        return -1;
+    }
+
+    if (base + offset < 0)
+        return -1;
+
+    ms->pos = (usize)(base + offset);
+    return 0;
+}
+
+static long mstream_tell(void* context) {
+    struct io_memstream* ms = context;
+    return (long)ms->pos;
+}
+
+static void mstream_close(void* context) {
+    free(context);
+}
+
+struct io_stream io_memopen(struct buffer_u8* buffer, const char* modes) {
+    struct io_stream io = { 0 };
+    struct io_memstream* ms = calloc(1, sizeof(struct io_memstream));
+    if (!ms) {
+        fprintf(stderr, "failed to allocate memory io descriptor: %s\n", strerror(errno));
+        return io;
+    }
+
+    ms->buffer = buffer;
+    ms->writable = modes[0] == 'w';
+    if (ms->writable) {
+        buffer->data = NULL;
+        buffer->len = 0;
+    }
+
+    io.context = ms;
+    io.read = mstream_read;
+    io.write = mstream_write;
+    io.seek = mstream_seek;
+    io.tell = mstream_tell;
+    io.close = mstream_close;
+    io.valid = true;
+
+    return io;
+}
+
+// The data is touched once from start to end, so the kernel can read ahead
+// aggressively and drop pages early
+static void mmap_advise(struct buffer_u8* buffer) {
+    if (buffer->len > 0)
+        madvise(buffer->data, buffer->len, MADV_SEQUENTIAL);
+}
+
+bool io_mmap(const char* path, struct buffer_u8* buffer) {
+    *buffer = (struct buffer_u8) { 0 };
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open file '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "file '%s' is not a regular file\n", path);
+        close(fd);
+        return false;
+    }
+
+    if ((u64)st.st_size > SIZE_MAX) {
+        fprintf(stderr, "file '%s' is too large to map\n", path);
+        close(fd);
+        return false;
+    }
+
+    if (st.st_size > 0) {
+        void* data = mmap(NULL, (usize)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "failed to map file '%s': %s\n", path, strerror(errno));
+            close(fd);
+            return false;
+        }
+
+        buffer->data = data;
+        buffer->len = (usize)st.st_size;
+    }
+
+    // The mapping stays valid once the descriptor is closed
+    close(fd);
+    mmap_advise(buffer);
+    return true;
+}
+
+bool io_mmap_create(const char* path, usize size, struct buffer_u8* buffer) {
+    *buffer = (struct buffer_u8) { 0 };
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open file '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+
+    if (ftruncate(fd, (off_t)size) != 0) {
+        fprintf(stderr, "failed to resize file '%s': %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    if (size > 0) {
+        void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "failed to map file '%s': %s\n", path, strerror(errno));
+            close(fd);
+            return false;
+        }
+
+        buffer->data = data;
+        buffer->len = size;
+    }
+
+    close(fd);
+    mmap_advise(buffer);
+    return true;
+}
+
+void io_munmap(struct buffer_u8* buffer) {
+    if (buffer->data)
+        munmap(buffer->data, buffer->len);
+
+    *buffer = (struct buffer_u8) { 0 };
+}
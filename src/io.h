@@ -25,9 +25,31 @@ struct io_stream {
     void (*close)(void* content);
 };
 
-// TODO: io_stream for memory buffers
+// Files don't have to be seekable, seeks and tells on pipes fail like they
+// would with fseek and ftell
 struct io_stream io_fopen(const char* path, const char* modes);
 
+// Wraps an already open file, like stdin or stdout. The file is left open when
+// the stream is closed.
+struct io_stream io_fwrap(FILE* file);
+
+// Opens a memory buffer as a stream. With "rb" the stream reads the buffer as
+// it is. With "wb" the buffer starts empty and grows as it is written to, the
+// stream keeps `buffer->data` and `buffer->len` up to date, and the caller
+// owns the memory once the stream is closed. The buffer must outlive the
+// stream in both modes.
+struct io_stream io_memopen(struct buffer_u8* buffer, const char* modes);
+
+// Maps a whole file into memory for reading. Empty files map to a NULL buffer.
+bool io_mmap(const char* path, struct buffer_u8* buffer);
+
+// Creates (or truncates) a file of `size` bytes and maps it for writing, the
+// data is written back to the file when it is unmapped
+bool io_mmap_create(const char* path, usize size, struct buffer_u8* buffer);
+
+// Unmaps a buffer from io_mmap or io_mmap_create
+void io_munmap(struct buffer_u8* buffer);
+
 usize io_write(struct io_stream* io, void* buffer, usize size);
 usize io_read(struct io_stream* io, void* buffer, usize size);
 long io_tell(struct io_stream* io);
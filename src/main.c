@@ -8,15 +8,25 @@
   along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+// for clock_gettime
+#define _DEFAULT_SOURCE
+
+#include "args.h"
 #include "huffman.h"
 #include "fformat.h"
 #include "io.h"
+#include "stats.h"
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-static struct buffer_u8 read_entire_file(const char* path);
 static void usage(const char* program, FILE* file);
+static bool is_std(const char* path);
+static struct io_stream open_input(const char* path);
+static struct io_stream open_output(const char* path);
+static struct fformat_table* load_table(const char* path);
+static int train(int argc, char** argv);
 
 // Since we can't recover from errors at all, we just exit :)
 #define DIE_IF(expr)        \
@@ -25,114 +35,362 @@ static void usage(const char* program, FILE* file);
     }
 
 int main(int argc, char** argv) {
-    if (argc != 4) {
+    if (argc < 4) {
         usage(argv[0], stderr);
         return EXIT_FAILURE;
     }
 
     const char* method = argv[1];
-    const char* target = argv[2];
-    const char* out_path = argv[3];
+    if (strcmp(method, "train") == 0)
+        return train(argc, argv);
 
-    if (strcmp(method, "c") == 0) {
-        struct buffer_u8 contents = read_entire_file(target);
-        DIE_IF(!contents.data);
+    const char* paths[4] = { 0 };
+    const char* table_path = NULL;
+    bool show_stats = false, stats_json = false;
+    int path_count = 0;
+    struct fformat_options options = fformat_default_options();
 
-        printf("- compressing '%s' of size %zu bytes\n", target, contents.len);
-        struct buffer_usize freqs = frequencies_build(&contents);
-        DIE_IF(!freqs.data);
+    for (int i = 2; i < argc; i++) {
+        const char* arg = argv[i];
+        unsigned long value;
 
-        struct pqueue queue = pqueue_build(freqs);
-        DIE_IF(!queue.items);
+        if (strcmp(arg, "-l") == 0 && i + 1 < argc) {
+            if (!parse_ulong(argv[++i], 8, FFORMAT_MAX_CODE_LEN, &value)) {
+                fprintf(stderr, "invalid code length limit '%s', expected 8 to %d\n", argv[i], FFORMAT_MAX_CODE_LEN);
+                return EXIT_FAILURE;
+            }
+            options.max_code_len = (u8)value;
+        } else if (strcmp(arg, "-b") == 0 && i + 1 < argc) {
+            if (!parse_size(argv[++i], FFORMAT_MIN_BLOCK_SIZE, FFORMAT_MAX_BLOCK_SIZE, &value)) {
+                fprintf(stderr, "invalid block size '%s', expected 4K to 64M\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            options.block_size = value;
+        } else if (strcmp(arg, "-T") == 0 && i + 1 < argc) {
+            if (!parse_ulong(argv[++i], 1, FFORMAT_MAX_THREADS, &value)) {
+                fprintf(stderr, "invalid thread count '%s', expected 1 to %d\n", argv[i], FFORMAT_MAX_THREADS);
+                return EXIT_FAILURE;
+            }
+            options.threads = value;
+        } else if (strcmp(arg, "-s") == 0 && i + 1 < argc) {
+            if (!parse_ulong(argv[++i], 1, FFORMAT_MAX_STREAMS, &value) || (value != 1 && value != 4 && value != 8)) {
+                fprintf(stderr, "invalid stream count '%s', expected 1, 4 or 8\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            options.streams = (u8)value;
+        } else if (strcmp(arg, "-r") == 0) {
+            options.rle = true;
+        } else if (strcmp(arg, "-C") == 0) {
+            options.context = true;
+        } else if (strcmp(arg, "-B") == 0) {
+            options.bwt = true;
+        } else if (strcmp(arg, "-S") == 0 && i + 1 < argc) {
+            if (!parse_ulong(argv[++i], 1, FFORMAT_MAX_SAMPLE_RATE, &value)) {
+                fprintf(stderr, "invalid sample rate '%s', expected 1 to %d\n", argv[i], FFORMAT_MAX_SAMPLE_RATE);
+                return EXIT_FAILURE;
+            }
+            options.sample_rate = value;
+        } else if (strcmp(arg, "-R") == 0 && i + 1 < argc) {
+            if (!parse_ulong(argv[++i], 0, 100, &value)) {
+                fprintf(stderr, "invalid table reuse threshold '%s', expected 0 to 100\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            options.table_reuse = (u8)value;
+        } else if (strcmp(arg, "-t") == 0 && i + 1 < argc) {
+            table_path = argv[++i];
+        } else if (strcmp(arg, "--stats") == 0 || strcmp(arg, "--stats-json") == 0) {
+            show_stats = true;
+            stats_json = strcmp(arg, "--stats-json") == 0;
+        } else if ((arg[0] == '-' && !is_std(arg)) || path_count == (int)countof(paths)) {
+            fprintf(stderr, "invalid argument '%s'\n", arg);
+            usage(argv[0], stderr);
+            return EXIT_FAILURE;
+        } else {
+            paths[path_count++] = arg;
+        }
+    }
 
-        struct helement* root = htree_build(&queue);
-        DIE_IF(!root);
+    // Range reads take <archive> <offset> <length> <output>
+    bool range = strcmp(method, "r") == 0;
+    if (path_count != (range ? 4 : 2)) {
+        usage(argv[0], stderr);
+        return EXIT_FAILURE;
+    }
 
-        struct buffer_hcode code_map;
-        buffer_alloc_z(&code_map, UINT8_MAX);
-        DIE_IF(!code_map.data);
+    const char* target = paths[0];
+    const char* out_path = range ? paths[3] : paths[1];
 
-        htree_encode(root, &code_map, 0, 0);
+    // Progress goes to stderr when the output is written to stdout. With
+    // --stats-json the progress lines are left out, so the stream only has JSON.
+    FILE* log = is_std(out_path) ? stderr : stdout;
 
-        struct io_stream io = io_fopen(out_path, "wb");
-        DIE_IF(!io.valid);
+    struct fformat_table* table = NULL;
+    if (table_path) {
+        table = load_table(table_path);
+        DIE_IF(!table);
+        options.table = table;
+    }
+
+#if HF_STATS
+    u64 start = stats_now();
+    if (show_stats)
+        stats_enable();
+#else
+    if (show_stats) {
+        fprintf(stderr, "statistics were disabled when building huffman\n");
+        return EXIT_FAILURE;
+    }
+#endif
+
+    if (strcmp(method, "c") == 0) {
+        // Files are mapped, so blocks are encoded straight from the page cache,
+        // stdin is streamed through one block at a time
+        struct buffer_u8 input = { 0 };
+        struct io_stream in = { 0 };
+        if (is_std(target)) {
+            in = io_fwrap(stdin);
+            DIE_IF(!in.valid);
+        } else {
+            DIE_IF(!io_mmap(target, &input));
+        }
+
+        struct io_stream out = open_output(out_path);
+        DIE_IF(!out.valid);
 
-        bool result = fformat_compress(&io, code_map, &contents);
+        if (!stats_json)
+            fprintf(log, "- compressing '%s' in blocks of %zu bytes\n", target, options.block_size);
+
+        struct fformat_stats stats = { 0 };
+        bool result = in.valid ? fformat_compress(&out, &in, &options, &stats)
+                               : fformat_compress_memory(&out, &input, &options, &stats);
         if (!result) {
             fprintf(stderr, "failed to compress file '%s'\n", target);
+        } else if (!stats_json) {
+            if (stats.content_bits > stats.unlimited_bits) {
+                double cost = 100.0 * (stats.content_bits - stats.unlimited_bits) / stats.unlimited_bits;
+                fprintf(log, "- code lengths limited to %u bits (content %.3f%% larger)\n", options.max_code_len, cost);
+            }
+
+            if (stats.content_bits > stats.exact_bits) {
+                double cost = 100.0 * (stats.content_bits - stats.exact_bits) / stats.exact_bits;
+                fprintf(log, "- code tables sampled from 1/%zu of the input (content %.3f%% larger)\n", options.sample_rate, cost);
+            }
+
+            if (stats.reused_blocks > 0)
+                fprintf(log, "- %llu blocks reused the code table of a previous block\n", (unsigned long long)stats.reused_blocks);
+
+            if (stats.context_blocks > 0)
+                fprintf(log, "- %llu blocks coded every byte with the table of the byte before it\n", (unsigned long long)stats.context_blocks);
+
+            if (stats.bwt_blocks > 0)
+                fprintf(log, "- %llu blocks were Burrows-Wheeler coded ahead of the Huffman codes\n", (unsigned long long)stats.bwt_blocks);
+
+            if (stats.stored_blocks > 0)
+                fprintf(log, "- %llu blocks didn't compress and were stored\n", (unsigned long long)stats.stored_blocks);
+
+            double ratio = stats.output_size ? (double)stats.input_size / stats.output_size : 0;
+            fprintf(log, "- read %llu bytes in %llu blocks\n", (unsigned long long)stats.input_size, (unsigned long long)stats.blocks);
+            fprintf(log, "- written to '%s' with '%llu' bytes (ratio of x%.2f)\n", out_path, (unsigned long long)stats.output_size, ratio);
+        }
+
+        io_munmap(&input);
+        io_close(&in);
+        io_close(&out);
+        DIE_IF(!result);
+    } else if (strcmp(method, "d") == 0) {
+        struct io_stream io = open_input(target);
+        DIE_IF(!io.valid);
+
+        // Output files are sized from the header and mapped, so blocks are
+        // decoded straight into the page cache. Pipes and streamed archives,
+        // which don't know their size, are written block by block instead.
+        u64 size = FFORMAT_UNKNOWN_SIZE;
+        if (!is_std(target) && !is_std(out_path))
+            DIE_IF(!fformat_original_size(&io, &size));
+
+        bool result;
+        if (size != FFORMAT_UNKNOWN_SIZE) {
+            if (size > SIZE_MAX) {
+                fprintf(stderr, "archive of '%llu' bytes is too large to decompress\n", (unsigned long long)size);
+                return EXIT_FAILURE;
+            }
+
+            struct buffer_u8 output;
+            DIE_IF(!io_mmap_create(out_path, (usize)size, &output));
+
+            result = fformat_decompress_into(&output, &io, options.threads, table);
+            io_munmap(&output);
         } else {
-            io_seek(&io, 0, SEEK_END);
-            long end = io_tell(&io);
-            double ratio = (double)contents.len / end;
-            printf("- written to '%s' with '%ld' bytes (ratio of x%.2f)\n", out_path, end, ratio);
+            struct io_stream os = open_output(out_path);
+            DIE_IF(!os.valid);
+
+            result = fformat_decompress(&os, &io, options.threads, table);
+            io_close(&os);
         }
 
+        if (!result)
+            fprintf(stderr, "failed to decompress file '%s'\n", target);
+
         io_close(&io);
-        buffer_free(&code_map);
-        tree_free(root);
-        pqueue_free(&queue);
-        buffer_free(&freqs);
-        buffer_free(&contents);
-    } else if (strcmp(method, "d") == 0) {
+        DIE_IF(!result);
+    } else if (range) {
+        unsigned long offset, length;
+        if (!parse_size(paths[1], 0, ULONG_MAX, &offset) || !parse_size(paths[2], 0, ULONG_MAX, &length)) {
+            fprintf(stderr, "invalid range '%s' '%s'\n", paths[1], paths[2]);
+            return EXIT_FAILURE;
+        }
+
         struct io_stream io = io_fopen(target, "rb");
         DIE_IF(!io.valid);
 
-        struct buffer_u8 data = fformat_decompress(&io);
-        DIE_IF(!data.data);
+        struct fformat_index index;
+        DIE_IF(!fformat_read_index(&io, &index));
+
+        struct buffer_u8 data;
+        bool result = fformat_read_range(&io, &index, table, offset, length, &data);
+        buffer_free(&index);
+        io_close(&io);
 
-        struct io_stream os = io_fopen(out_path, "wb");
+        if (!result) {
+            fprintf(stderr, "failed to read range of '%s'\n", target);
+            return EXIT_FAILURE;
+        }
+
+        struct io_stream os = open_output(out_path);
         DIE_IF(!os.valid);
 
-        io_write(&os, data.data, data.len * sizeof(u8));
+        bool written = io_write(&os, data.data, data.len) == data.len;
+        if (!written)
+            fprintf(stderr, "failed to write range to '%s': %s\n", out_path, strerror(errno));
 
-        io_close(&io);
         io_close(&os);
         buffer_free(&data);
+        DIE_IF(!written);
     } else {
         fprintf(stderr, "invalid option '%s'\n", method);
         usage(argv[0], stderr);
         return EXIT_FAILURE;
     }
 
+#if HF_STATS
+    if (show_stats)
+        stats_print(log, stats_json, stats_now() - start);
+#else
+    (void)stats_json;
+#endif
+
+    free(table);
     return 0;
 }
 
-static void usage(const char* program, FILE* file) {
-    fprintf(file, "usage: %s <c|d> <input> <output>\n", program);
-}
+// Trains a static table on the byte frequencies of every sample and saves it
+static int train(int argc, char** argv) {
+    u8 max_code_len = FFORMAT_MAX_CODE_LEN;
+    int i = 2;
+    if (i + 1 < argc && strcmp(argv[i], "-l") == 0) {
+        unsigned long value;
+        if (!parse_ulong(argv[i + 1], 8, FFORMAT_MAX_CODE_LEN, &value)) {
+            fprintf(stderr, "invalid code length limit '%s', expected 8 to %d\n", argv[i + 1], FFORMAT_MAX_CODE_LEN);
+            return EXIT_FAILURE;
+        }
+        max_code_len = (u8)value;
+        i += 2;
+    }
+
+    if (argc - i < 2) {
+        usage(argv[0], stderr);
+        return EXIT_FAILURE;
+    }
 
-static struct buffer_u8 read_entire_file(const char* path) {
-    struct buffer_u8 contents = { 0 };
+    const char* table_path = argv[i++];
+    int samples = argc - i;
+    usize freqs[ALPHABET_SIZE] = { 0 };
+    u64 total = 0;
 
-    FILE* fp = fopen(path, "rb");
-    if (fp == NULL) {
-        fprintf(stderr, "failed to open '%s': %s\n", path, strerror(errno));
-        return contents;
+    for (; i < argc; i++) {
+        struct buffer_u8 sample;
+        DIE_IF(!io_mmap(argv[i], &sample));
+
+        usize counts[ALPHABET_SIZE];
+        frequencies_count(&sample, counts);
+        for (usize j = 0; j < ALPHABET_SIZE; j++)
+            freqs[j] += counts[j];
+
+        total += sample.len;
+        io_munmap(&sample);
     }
 
-    if (fseek(fp, 0, SEEK_END) == ESPIPE) {
-        fprintf(stderr, "file '%s' is not seekable\n", path);
-        fclose(fp);
-        return contents;
+    struct fformat_table* table = malloc(sizeof(struct fformat_table));
+    if (!table) {
+        fprintf(stderr, "failed to allocate table: %s\n", strerror(errno));
+        return EXIT_FAILURE;
     }
 
-    long file_size = ftell(fp);
-    if (file_size == -1) {
-        fprintf(stderr, "error while querying file size: %s\n", strerror(errno));
-        fclose(fp);
-        return contents;
+    bool result = fformat_table_train(table, freqs, max_code_len);
+    if (result) {
+        struct io_stream out = io_fopen(table_path, "wb");
+        result = out.valid && fformat_table_write(table, &out);
+        io_close(&out);
     }
 
-    buffer_alloc(&contents, file_size);
-    if (contents.data == NULL) {
-        fprintf(stderr, "failed to allocate memory for file: %s\n", strerror(errno));
-        fclose(fp);
-        return contents;
+    if (result)
+        printf("- trained table %08x on %llu bytes from %d samples, written to '%s'\n", table->id, (unsigned long long)total, samples, table_path);
+    else
+        fprintf(stderr, "failed to train table '%s'\n", table_path);
+
+    free(table);
+    return result ? 0 : EXIT_FAILURE;
+}
+
+static void usage(const char* program, FILE* file) {
+    fprintf(file, "usage: %s <c|d> [options] <input> <output>\n", program);
+    fprintf(file, "       %s r [-t <table>] <archive> <offset> <length> <output>\n", program);
+    fprintf(file, "       %s train [-l <bits>] <table> <samples...>\n", program);
+    fprintf(file, "<input> and <output> can be '-' for stdin and stdout\n");
+    fprintf(file, "options:\n");
+    fprintf(file, "  -l <bits>  limit code lengths to 8..%d bits (default: %d)\n", FFORMAT_MAX_CODE_LEN, FFORMAT_MAX_CODE_LEN);
+    fprintf(file, "  -b <size>  compress in blocks of <size> bytes, K and M suffixes allowed (default: 1M)\n");
+    fprintf(file, "  -T <n>     compress or decompress blocks on <n> threads (default: 1)\n");
+    fprintf(file, "  -s <n>     split every block in 1, 4 or 8 interleaved bitstreams (default: 1)\n");
+    fprintf(file, "  -r         run-length code long runs of the same byte before Huffman coding\n");
+    fprintf(file, "  -C         code every byte with a table picked by the byte before it, when that is smaller\n");
+    fprintf(file, "  -B         Burrows-Wheeler transform and move-to-front code blocks first, when that is smaller\n");
+    fprintf(file, "  -S <n>     build code tables from 1/<n> of every block, 1..%d (default: 1, every byte)\n", FFORMAT_MAX_SAMPLE_RATE);
+    fprintf(file, "  -R <pct>   reuse a recent code table when it is within <pct>%% of the entropy, 0 never (default: 1)\n");
+    fprintf(file, "  -t <table> code every block with a static table made by train, needed again to decompress\n");
+    fprintf(file, "  --stats    print the time spent in every phase and the code length distribution\n");
+    fprintf(file, "  --stats-json  like --stats, formatted as JSON alone on stdout, or stderr when <output> is stdout\n");
+}
+
+// "-" stands for stdin or stdout
+static bool is_std(const char* path) {
+    return strcmp(path, "-") == 0;
+}
+
+static struct io_stream open_input(const char* path) {
+    return is_std(path) ? io_fwrap(stdin) : io_fopen(path, "rb");
+}
+
+static struct io_stream open_output(const char* path) {
+    return is_std(path) ? io_fwrap(stdout) : io_fopen(path, "wb");
+}
+
+static struct fformat_table* load_table(const char* path) {
+    struct fformat_table* table = malloc(sizeof(struct fformat_table));
+    if (!table) {
+        fprintf(stderr, "failed to allocate table: %s\n", strerror(errno));
+        return NULL;
     }
 
-    rewind(fp);
-    fread(contents.data, sizeof(u8), file_size, fp);
-    fclose(fp);
+    struct io_stream io = io_fopen(path, "rb");
+    bool ok = io.valid && fformat_table_read(table, &io);
+    io_close(&io);
+
+    if (!ok) {
+        fprintf(stderr, "failed to read table '%s'\n", path);
+        free(table);
+        return NULL;
+    }
 
-    return contents;
+    return table;
 }
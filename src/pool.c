@@ -0,0 +1,134 @@
+/*
+  Copyright (C) 2025  leleneme
+  This file is part of huffman, which is free software:
+  you can redistribute it and/or modify   it under the terms of the
+  GNU General Public License as published by the Free Software Foundation,
+  either version 3 of the License, or (at your option) any later version.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "pool.h"
+#include <errno.h>
+#include <pthread.h>
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t has_work; // signaled when a task is queued or on shutdown
+    pthread_cond_t finished; // broadcast whenever a task is done
+
+    struct pool_task *head, *tail;
+    bool stopping;
+
+    pthread_t* threads;
+    usize thread_count;
+};
+
+static void* pool_worker(void* context) {
+    struct pool* pool = context;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->head && !pool->stopping)
+            pthread_cond_wait(&pool->has_work, &pool->lock);
+
+        if (!pool->head)
+            break;
+
+        struct pool_task* task = pool->head;
+        pool->head = task->next;
+        if (!pool->head)
+            pool->tail = NULL;
+
+        pthread_mutex_unlock(&pool->lock);
+        task->run(task->arg);
+        pthread_mutex_lock(&pool->lock);
+
+        task->done = true;
+        pthread_cond_broadcast(&pool->finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+struct pool* pool_create(usize threads) {
+    struct pool* pool = calloc(1, sizeof(struct pool));
+    if (!pool) {
+        fprintf(stderr, "error: failed to allocate thread pool: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    pool->threads = calloc(threads, sizeof(pthread_t));
+    if (!pool->threads) {
+        fprintf(stderr, "error: failed to allocate thread pool: %s\n", strerror(errno));
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->has_work, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    for (usize i = 0; i < threads; i++) {
+        int err = pthread_create(&pool->threads[i], NULL, pool_worker, pool);
+        if (err != 0) {
+            fprintf(stderr, "error: failed to start worker thread: %s\n", strerror(err));
+            pool_destroy(pool);
+            return NULL;
+        }
+
+        pool->thread_count++;
+    }
+
+    return pool;
+}
+
+void pool_submit(struct pool* pool, struct pool_task* task) {
+    task->done = false;
+    task->next = NULL;
+
+    if (!pool) {
+        task->run(task->arg);
+        task->done = true;
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail)
+        pool->tail->next = task;
+    else
+        pool->head = task;
+    pool->tail = task;
+    pthread_cond_signal(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(struct pool* pool, struct pool_task* task) {
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!task->done)
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(struct pool* pool) {
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (usize i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->has_work);
+    pthread_cond_destroy(&pool->finished);
+    free(pool->threads);
+    free(pool);
+}
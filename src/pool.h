@@ -0,0 +1,43 @@
+/*
+  Copyright (C) 2025  leleneme
+  This file is part of huffman, which is free software:
+  you can redistribute it and/or modify   it under the terms of the
+  GNU General Public License as published by the Free Software Foundation,
+  either version 3 of the License, or (at your option) any later version.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HF_POOL_H
+#define HF_POOL_H
+
+#include "huffman.h"
+#include <stdbool.h>
+
+// A fixed set of worker threads running tasks in submission order. Tasks are
+// owned by the caller and must stay alive until pool_wait returns for them.
+struct pool;
+
+struct pool_task {
+    void (*run)(void* arg);
+    void* arg;
+
+    // Managed by the pool
+    bool done;
+    struct pool_task* next;
+};
+
+// Returns NULL on failure
+struct pool* pool_create(usize threads);
+
+// Queues a task. With a NULL pool the task runs right away on the calling
+// thread, so callers can use the same code for the single-threaded case.
+void pool_submit(struct pool*, struct pool_task*);
+
+// Blocks until a submitted task has finished running
+void pool_wait(struct pool*, struct pool_task*);
+
+// Waits for the queued tasks to finish and joins the threads
+void pool_destroy(struct pool*);
+
+#endif
@@ -0,0 +1,101 @@
+/*
+  Copyright (C) 2025  leleneme
+  This file is part of huffman, which is free software:
+  you can redistribute it and/or modify   it under the terms of the
+  GNU General Public License as published by the Free Software Foundation,
+  either version 3 of the License, or (at your option) any later version.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// for clock_gettime
+#define _DEFAULT_SOURCE
+
+#include "stats.h"
+
+#if HF_STATS
+
+static const char* PHASE_NAMES[STATS_PHASE_COUNT] = {
+    "read",
+    "frequencies",
+    "tree",
+    "encode",
+    "table",
+    "decode",
+    "transform",
+    "write",
+};
+
+bool stats_enabled;
+
+// Updated from every thread compressing or decompressing blocks
+static struct stats stats;
+
+void stats_enable(void) {
+    stats_enabled = true;
+}
+
+void stats_add_time(enum stats_phase phase, u64 start) {
+    __atomic_fetch_add(&stats.ns[phase], stats_now() - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.calls[phase], 1, __ATOMIC_RELAXED);
+}
+
+void stats_add_codes(struct buffer_hcode code_map, const u8* symbols, usize len) {
+    u64 counts[HCODE_MAX_LEN + 1] = { 0 };
+    for (usize i = 0; i < len; i++)
+        counts[code_map.data[symbols[i]].bit_len]++;
+
+    for (usize l = 0; l <= HCODE_MAX_LEN; l++) {
+        if (counts[l])
+            __atomic_fetch_add(&stats.code_lengths[l], counts[l], __ATOMIC_RELAXED);
+    }
+}
+
+void stats_add_freqs(struct buffer_hcode code_map, struct buffer_usize freqs) {
+    for (usize i = 0; i < freqs.len; i++) {
+        if (freqs.data[i])
+            __atomic_fetch_add(&stats.code_lengths[code_map.data[i].bit_len], freqs.data[i], __ATOMIC_RELAXED);
+    }
+}
+
+void stats_print(FILE* file, bool json, u64 wall_ns) {
+    u64 symbols = 0, bits = 0;
+    for (usize l = 0; l <= HCODE_MAX_LEN; l++) {
+        symbols += stats.code_lengths[l];
+        bits += stats.code_lengths[l] * l;
+    }
+
+    double average = symbols ? (double)bits / symbols : 0;
+
+    if (json) {
+        fprintf(file, "{\n  \"wall_ns\": %llu,\n  \"phases\": {\n", (unsigned long long)wall_ns);
+        for (usize p = 0; p < STATS_PHASE_COUNT; p++) {
+            fprintf(file, "    \"%s\": { \"ns\": %llu, \"calls\": %llu }%s\n", PHASE_NAMES[p], (unsigned long long)stats.ns[p],
+                (unsigned long long)stats.calls[p], p + 1 < STATS_PHASE_COUNT ? "," : "");
+        }
+
+        fprintf(file, "  },\n  \"code_lengths\": [");
+        for (usize l = 0; l <= HCODE_MAX_LEN; l++)
+            fprintf(file, "%llu%s", (unsigned long long)stats.code_lengths[l], l < HCODE_MAX_LEN ? ", " : "");
+        fprintf(file, "],\n  \"symbols\": %llu,\n  \"bits_per_symbol\": %.4f\n}\n", (unsigned long long)symbols, average);
+        return;
+    }
+
+    fprintf(file, "- wall time %.3f ms\n", wall_ns / 1e6);
+    for (usize p = 0; p < STATS_PHASE_COUNT; p++) {
+        if (stats.calls[p]) {
+            fprintf(file, "  %-12s %10.3f ms in %llu calls\n", PHASE_NAMES[p], stats.ns[p] / 1e6,
+                (unsigned long long)stats.calls[p]);
+        }
+    }
+
+    if (symbols) {
+        fprintf(file, "- %llu symbols encoded with %.3f bits on average\n", (unsigned long long)symbols, average);
+        for (usize l = 1; l <= HCODE_MAX_LEN; l++) {
+            if (stats.code_lengths[l])
+                fprintf(file, "  %2zu bits %8.4f%%\n", l, 100.0 * stats.code_lengths[l] / symbols);
+        }
+    }
+}
+
+#endif
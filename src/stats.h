@@ -0,0 +1,90 @@
+/*
+  Copyright (C) 2025  leleneme
+  This file is part of huffman, which is free software:
+  you can redistribute it and/or modify   it under the terms of the
+  GNU General Public License as published by the Free Software Foundation,
+  either version 3 of the License, or (at your option) any later version.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HF_STATS_H
+#define HF_STATS_H
+
+#include "huffman.h"
+#include <stdbool.h>
+
+// Instrumentation of the compression and decompression phases. Timers and
+// counters are only updated once stats_enable was called, and build with
+// -DHF_STATS=0 to compile them out entirely.
+#ifndef HF_STATS
+#define HF_STATS 1
+#endif
+
+enum stats_phase {
+    STATS_READ,
+    STATS_FREQUENCIES,
+    STATS_TREE,      // building the codes of a block, or picking a cached table
+    STATS_ENCODE,    // packing the codes into bitstreams
+    STATS_TABLE,     // building decode tables
+    STATS_DECODE,
+    STATS_TRANSFORM, // the Burrows-Wheeler transform and its inverse
+    STATS_WRITE,
+    STATS_PHASE_COUNT,
+};
+
+#if HF_STATS
+#include <time.h>
+
+// Phases running on several threads add up the time of every thread
+struct stats {
+    u64 ns[STATS_PHASE_COUNT];
+    u64 calls[STATS_PHASE_COUNT];
+    u64 code_lengths[HCODE_MAX_LEN + 1]; // symbols encoded with codes of each length
+};
+
+extern bool stats_enabled;
+
+static inline u64 stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+void stats_enable(void);
+void stats_add_time(enum stats_phase, u64 start);
+
+// Adds how many of `symbols` are encoded with codes of each length
+void stats_add_codes(struct buffer_hcode, const u8* symbols, usize len);
+
+// Same as stats_add_codes, from how many times each symbol was encoded
+void stats_add_freqs(struct buffer_hcode, struct buffer_usize freqs);
+
+// Prints the phases, the code length distribution and the average code length
+void stats_print(FILE*, bool json, u64 wall_ns);
+
+// Times the code between STATS_BEGIN and STATS_END
+#define STATS_BEGIN(timer) u64 timer = stats_enabled ? stats_now() : 0
+#define STATS_END(phase, timer)           \
+    do {                                  \
+        if (stats_enabled)                \
+            stats_add_time(phase, timer); \
+    } while (0)
+#define STATS_CODES(code_map, symbols, len)          \
+    do {                                             \
+        if (stats_enabled)                           \
+            stats_add_codes(code_map, symbols, len); \
+    } while (0)
+#define STATS_FREQS(code_map, freqs)          \
+    do {                                      \
+        if (stats_enabled)                    \
+            stats_add_freqs(code_map, freqs); \
+    } while (0)
+#else
+#define STATS_BEGIN(timer) ((void)0)
+#define STATS_END(phase, timer) ((void)0)
+#define STATS_CODES(code_map, symbols, len) ((void)0)
+#define STATS_FREQS(code_map, freqs) ((void)0)
+#endif
+
+#endif